@@ -0,0 +1,117 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ATOMICSTRONGCELL_H
+#define BITCOIN_ATOMICSTRONGCELL_H
+
+#include "strong_ptr.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/**
+ * A strong_ptr that readers can take loans of while writers replace it, for
+ * read-mostly data such as configuration or routing tables. Writers get the
+ * previous value back as a decay_ptr, to wait for its readers to finish with
+ * it, or to hand to a strong_reclaimer.
+ *
+ * The value lives in one of two slots, and m_active says which. A reader
+ * announces itself in that slot's counter, checks that the slot is still
+ * active, and copies a loan out of it. A writer, holding m_write_mut, fills
+ * the other slot, makes it the active one, and waits for the readers still
+ * copying from the old slot before taking its value out. Readers never lock
+ * or wait: if a writer switches slots under them, they just try again.
+ * Writers only wait for readers that are in the middle of taking a loan,
+ * never for the loans themselves.
+ */
+template <typename T>
+class atomic_strong_cell
+{
+public:
+    atomic_strong_cell() = default;
+    explicit atomic_strong_cell(strong_ptr<T>&& value)
+    {
+        m_slots[0].m_value = std::move(value);
+    }
+
+    atomic_strong_cell(const atomic_strong_cell&) = delete;
+    atomic_strong_cell& operator=(const atomic_strong_cell&) = delete;
+
+    /** Take a loan of the current value, which may be null. */
+#if STRONG_PTR_INSTRUMENT >= 2
+    std::shared_ptr<T> get_shared(strong_loan_site site = strong_loan_site::current()) const
+#else
+    std::shared_ptr<T> get_shared() const
+#endif
+    {
+        while (true) {
+            const slot& current = m_slots[m_active.load(std::memory_order_seq_cst)];
+            // seq_cst so that either the writer sees us in the counter, or
+            // we see its switch to the other slot.
+            current.m_readers.fetch_add(1, std::memory_order_seq_cst);
+            if (&m_slots[m_active.load(std::memory_order_seq_cst)] == &current) {
+#if STRONG_PTR_INSTRUMENT >= 2
+                std::shared_ptr<T> loan = current.m_value.get_shared(site);
+#else
+                std::shared_ptr<T> loan = current.m_value.get_shared();
+#endif
+                current.m_readers.fetch_sub(1, std::memory_order_release);
+                return loan;
+            }
+            current.m_readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    /** Replace the value with desired, returning the previous one. */
+    decay_ptr<T> exchange(strong_ptr<T>&& desired)
+    {
+        std::lock_guard<std::mutex> lock(m_write_mut);
+        const unsigned old_index = m_active.load(std::memory_order_relaxed);
+        slot& next = m_slots[old_index ^ 1];
+        slot& old = m_slots[old_index];
+        // Readers that saw the previous switch late may still be backing
+        // out of next; none of them touch its value.
+        drain(next);
+        next.m_value = std::move(desired);
+        m_active.store(old_index ^ 1, std::memory_order_seq_cst);
+        drain(old);
+        return decay_ptr<T>(std::move(old.m_value));
+    }
+
+    /** Like exchange(). */
+    decay_ptr<T> store(strong_ptr<T>&& desired)
+    {
+        return exchange(std::move(desired));
+    }
+
+private:
+    // Padded so that the two counters don't share a cache line.
+    struct slot {
+        strong_ptr<T> m_value;
+        mutable std::atomic<std::size_t> m_readers{0};
+        unsigned char m_padding[64];
+    };
+
+    static void drain(const slot& s)
+    {
+        unsigned spins = 0;
+        while (s.m_readers.load(std::memory_order_seq_cst) != 0) {
+            if (++spins < 64) {
+                strong_cpu_relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    slot m_slots[2];
+    std::atomic<unsigned> m_active{0};
+    std::mutex m_write_mut;
+};
+
+#endif // BITCOIN_ATOMICSTRONGCELL_H
@@ -0,0 +1,315 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Micro-benchmarks for the strong_ptr hot paths, each next to the closest
+// std smart pointer equivalent. Build with optimizations, e.g.:
+//   c++ -std=c++14 -O2 -pthread bench_strong_ptr.cpp -o bench_strong_ptr
+// Pass a number to limit the number of threads used for contended runs.
+
+#include "strong_ptr.h"
+#include "atomic_strong_cell.h"
+#include "intrusive_strong_ptr.h"
+#include "numa_strong_ptr.h"
+#include "strong_pool.h"
+#include "strong_reclaimer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+struct payload
+{
+    explicit payload(int value) : m_value{value} {}
+    int m_value;
+    char m_padding[60];
+};
+
+struct hooked_payload : strong_ptr_hook
+{
+    explicit hooked_payload(int value) : m_value{value} {}
+    int m_value;
+    char m_padding[60];
+};
+
+template <typename T>
+inline void do_not_optimize(const T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+void report(const std::string& name, double ns_per_op)
+{
+    std::printf("%-48s %10.1f ns/op\n", name.c_str(), ns_per_op);
+}
+
+/** Best of a few runs of iters calls to fn, in ns per call. */
+template <typename Fn>
+double measure(std::size_t iters, Fn fn)
+{
+    double best = 0;
+    for (int run = 0; run < 5; ++run) {
+        const auto start = bench_clock::now();
+        for (std::size_t i = 0; i < iters; ++i) {
+            fn();
+        }
+        const std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+        const double ns = elapsed.count() / iters;
+        if (run == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+template <typename Fn>
+void bench(const std::string& name, std::size_t iters, Fn fn)
+{
+    report(name, measure(iters, fn));
+}
+
+/**
+ * Run fn(thread index) iters times on each of threads threads at once, and
+ * report the wall time per call on a single thread.
+ */
+template <typename Fn>
+void bench_threads(const std::string& name, unsigned threads, std::size_t iters, Fn fn)
+{
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<double> results(threads);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            ++ready;
+            while (!go.load()) std::this_thread::yield();
+            const auto start = bench_clock::now();
+            for (std::size_t i = 0; i < iters; ++i) {
+                fn(t);
+            }
+            const std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+            results[t] = elapsed.count() / iters;
+        });
+    }
+    while (ready.load() != threads) std::this_thread::yield();
+    go = true;
+    for (auto& worker : workers) worker.join();
+    report(name + " (" + std::to_string(threads) + " threads)", *std::max_element(results.begin(), results.end()));
+}
+
+void bench_creation()
+{
+    const std::size_t iters = 1000000;
+    bench("make_strong", iters, [] { do_not_optimize(make_strong<payload>(1)); });
+    bench("std::make_shared", iters, [] { do_not_optimize(std::make_shared<payload>(1)); });
+    bench("make_intrusive_strong", iters, [] { do_not_optimize(make_intrusive_strong<hooked_payload>(1)); });
+    bench("std::make_unique", iters, [] { do_not_optimize(std::make_unique<payload>(1)); });
+    bench("strong_ptr(new T)", iters, [] { do_not_optimize(strong_ptr<payload>(new payload(1))); });
+    bench("std::shared_ptr(new T)", iters, [] { do_not_optimize(std::shared_ptr<payload>(new payload(1))); });
+    strong_ptr<payload> strong;
+    bench("strong_ptr::reset(new T)", iters, [&] { strong.reset(new payload(1)); });
+    std::shared_ptr<payload> shared;
+    bench("std::shared_ptr::reset(new T)", iters, [&] { shared.reset(new payload(1)); });
+}
+
+void bench_loans(unsigned max_threads)
+{
+    const std::size_t iters = 1000000;
+    const strong_ptr<payload> strong = make_strong<payload>(1);
+    strong_ptr<payload> sharded = make_strong<payload>(1);
+    sharded.enable_sharding(max_threads);
+    const std::shared_ptr<payload> shared = std::make_shared<payload>(1);
+    const atomic_strong_cell<payload> cell(make_strong<payload>(1));
+    const replicated_strong_ptr<payload> replicated = make_replicated_strong<payload>(1);
+    bench("strong_ptr::borrow()", iters, [&] { do_not_optimize(strong.borrow()); });
+    const intrusive_strong_ptr<hooked_payload> intrusive = make_intrusive_strong<hooked_payload>(1);
+    bench("intrusive_strong_ptr::get_shared()", iters, [&] { do_not_optimize(intrusive.get_shared()); });
+    const strong_ptr<payload, single_thread> local = make_strong<payload>(1);
+    bench("strong_ptr<T, single_thread>::get_shared()", iters, [&] { do_not_optimize(local.get_shared()); });
+    const weak_loan<payload> weak_strong = strong.get_weak();
+    bench("weak_loan::lock()", iters, [&] { do_not_optimize(weak_strong.lock()); });
+    const std::weak_ptr<payload> weak_shared = shared;
+    bench("std::weak_ptr::lock()", iters, [&] { do_not_optimize(weak_shared.lock()); });
+    bench("8x strong_ptr::get_shared()", iters, [&] {
+        std::shared_ptr<payload> loans[8];
+        for (auto& loan : loans) loan = strong.get_shared();
+        do_not_optimize(loans);
+    });
+    bench("strong_ptr::get_shared_n(8), split and merged", iters, [&] {
+        loan_batch<payload> batch = strong.get_shared_n(8);
+        loan_batch<payload> loans[8];
+        for (auto& loan : loans) loan = batch.split();
+        do_not_optimize(loans);
+        for (auto& loan : loans) batch.merge(std::move(loan));
+    });
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        bench_threads("strong_ptr::get_shared()", threads, iters, [&](unsigned) { do_not_optimize(strong.get_shared()); });
+        bench_threads("strong_ptr::get_shared() sharded", threads, iters, [&](unsigned) { do_not_optimize(sharded.get_shared()); });
+        bench_threads("atomic_strong_cell::get_shared()", threads, iters, [&](unsigned) { do_not_optimize(cell.get_shared()); });
+        bench_threads("replicated_strong_ptr::get_shared()", threads, iters, [&](unsigned) { do_not_optimize(replicated.get_shared()); });
+        bench_threads("std::shared_ptr copy", threads, iters, [&](unsigned) { do_not_optimize(std::shared_ptr<payload>(shared)); });
+    }
+}
+
+void bench_decay()
+{
+    const std::size_t iters = 1000000;
+    bench("make_strong + decay_ptr", iters, [] {
+        decay_ptr<payload> degraded(make_strong<payload>(1));
+        do_not_optimize(degraded);
+    });
+    bench("std::make_unique + move", iters, [] {
+        std::unique_ptr<payload> unique = std::make_unique<payload>(1);
+        std::unique_ptr<payload> moved(std::move(unique));
+        do_not_optimize(moved);
+    });
+
+    strong_ptr<payload> recycled = make_strong<payload>(1);
+    bench("loan + decay + rearm", iters, [&] {
+        auto shared = recycled.get_shared();
+        decay_ptr<payload> degraded(std::move(recycled));
+        shared.reset();
+        recycled = degraded.rearm();
+    });
+    strong_pool<payload> pool;
+    recycled = pool.make(1);
+    bench("loan + decay + strong_pool::make", iters, [&] {
+        auto shared = recycled.get_shared();
+        decay_ptr<payload> degraded(std::move(recycled));
+        shared.reset();
+        degraded.reset();
+        recycled = pool.make(1);
+    });
+    bench("loan + decay + make_strong", iters, [&] {
+        auto shared = recycled.get_shared();
+        decay_ptr<payload> degraded(std::move(recycled));
+        shared.reset();
+        recycled = make_strong<payload>(1);
+    });
+
+    {
+        strong_reclaimer reclaimer;
+        bench("make_strong + loan + strong_reclaimer::retire", iters, [&] {
+            strong_ptr<payload> retired = make_strong<payload>(1);
+            auto shared = retired.get_shared();
+            reclaimer.retire(std::move(retired));
+        });
+    }
+
+    strong_ptr<payload> strong = make_strong<payload>(1);
+    auto loan = strong.get_shared();
+    const decay_ptr<payload> degraded(std::move(strong));
+    std::weak_ptr<payload> weak = loan;
+    bench("decay_ptr::decayed()", iters * 10, [&] { do_not_optimize(degraded.decayed()); });
+    bench("std::weak_ptr::expired()", iters * 10, [&] { do_not_optimize(weak.expired()); });
+}
+
+/**
+ * Time from a thread dropping the last loan to wait() returning on another,
+ * next to a plain condition variable handoff.
+ */
+void bench_wakeup()
+{
+    const int rounds = 2000;
+    std::vector<double> latencies;
+    latencies.reserve(rounds);
+    auto median = [&latencies] {
+        std::sort(latencies.begin(), latencies.end());
+        const double result = latencies[latencies.size() / 2];
+        latencies.clear();
+        return result;
+    };
+
+    for (int i = 0; i < rounds; ++i) {
+        strong_ptr<payload> strong = make_strong<payload>(i);
+        std::atomic<bool> started{false};
+        bench_clock::time_point released;
+        std::thread holder([&](std::shared_ptr<payload> loan) {
+            while (!started.load()) std::this_thread::yield();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            released = bench_clock::now();
+            loan.reset();
+        }, strong.get_shared());
+        decay_ptr<payload> degraded(std::move(strong));
+        started = true;
+        degraded.wait();
+        const bench_clock::time_point woken = bench_clock::now();
+        holder.join();
+        latencies.push_back(std::chrono::duration<double, std::nano>(woken - released).count());
+    }
+    report("last loan -> decay_ptr::wait() (median)", median());
+
+    for (int i = 0; i < rounds; ++i) {
+        strong_ptr<payload> strong = make_strong<payload>(i);
+        std::atomic<bool> started{false};
+        bench_clock::time_point released;
+        std::thread holder([&](std::shared_ptr<payload> loan) {
+            while (!started.load()) std::this_thread::yield();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            released = bench_clock::now();
+            loan.reset();
+        }, strong.get_shared());
+        decay_ptr<payload> degraded(std::move(strong));
+        started = true;
+        degraded.wait(spin_then_block());
+        const bench_clock::time_point woken = bench_clock::now();
+        holder.join();
+        latencies.push_back(std::chrono::duration<double, std::nano>(woken - released).count());
+    }
+    report("last loan -> wait(spin_then_block) (median)", median());
+
+    for (int i = 0; i < rounds; ++i) {
+        std::mutex mut;
+        std::condition_variable cond;
+        bool done = false;
+        std::atomic<bool> started{false};
+        bench_clock::time_point released;
+        std::thread holder([&] {
+            while (!started.load()) std::this_thread::yield();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            released = bench_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                done = true;
+            }
+            cond.notify_all();
+        });
+        started = true;
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            cond.wait(lock, [&] { return done; });
+        }
+        const bench_clock::time_point woken = bench_clock::now();
+        holder.join();
+        latencies.push_back(std::chrono::duration<double, std::nano>(woken - released).count());
+    }
+    report("std::condition_variable handoff (median)", median());
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc > 1) max_threads = std::max(1, std::atoi(argv[1]));
+
+    bench_creation();
+    bench_loans(max_threads);
+    bench_decay();
+    bench_wakeup();
+}
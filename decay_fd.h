@@ -0,0 +1,154 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_DECAYFD_H
+#define BITCOIN_DECAYFD_H
+
+#include "decay_set.h"
+#include "strong_ptr.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#error "decay_fd.h needs POSIX file descriptors"
+#endif
+
+/**
+ * A file descriptor that becomes readable once a watched pointer decays, so
+ * that an event loop can wait for decays in the same poll/epoll/kqueue call
+ * as for everything else. It is an eventfd on Linux and a non-blocking pipe
+ * elsewhere.
+ *
+ * The descriptor stays readable until reset(). It is closed once both the
+ * decay_fd and the callbacks of everything it watches are gone, so a late
+ * decay can't write to a descriptor number that has been reused.
+ */
+class decay_fd
+{
+    struct handle {
+        handle()
+        {
+#if defined(__linux__)
+            m_read = m_write = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_read < 0) throw std::system_error(errno, std::generic_category(), "eventfd");
+#else
+            int fds[2];
+            if (::pipe(fds) != 0) throw std::system_error(errno, std::generic_category(), "pipe");
+            for (int fd : fds) {
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            m_read = fds[0];
+            m_write = fds[1];
+#endif
+        }
+        handle(const handle&) = delete;
+        handle& operator=(const handle&) = delete;
+        ~handle()
+        {
+            ::close(m_read);
+            if (m_write != m_read) ::close(m_write);
+        }
+
+        void signal() const noexcept
+        {
+            // Failing with EAGAIN means the descriptor is readable already.
+#if defined(__linux__)
+            const std::uint64_t one = 1;
+#else
+            const char one = 1;
+#endif
+            while (::write(m_write, &one, sizeof(one)) < 0 && errno == EINTR) {
+            }
+        }
+
+        bool reset() const noexcept
+        {
+            bool signaled = false;
+#if defined(__linux__)
+            std::uint64_t count;
+            ssize_t got;
+            while ((got = ::read(m_read, &count, sizeof(count))) < 0 && errno == EINTR) {
+            }
+            signaled = got > 0;
+#else
+            char buf[64];
+            ssize_t got;
+            while ((got = ::read(m_read, buf, sizeof(buf))) > 0 || (got < 0 && errno == EINTR)) {
+                if (got > 0) signaled = true;
+            }
+#endif
+            return signaled;
+        }
+
+        int m_read;
+        int m_write;
+    };
+
+public:
+    /** Throws std::system_error if the descriptor can't be created. */
+    decay_fd() : m_handle{std::make_shared<handle>()} {}
+
+    decay_fd(const decay_fd&) = delete;
+    decay_fd& operator=(const decay_fd&) = delete;
+
+    /** The descriptor to poll for readability. */
+    int fd() const
+    {
+        return m_handle->m_read;
+    }
+
+    /**
+     * Become readable once ptr has decayed, right away if it already has.
+     * This uses ptr's on_decay() slot.
+     */
+    template <typename T, typename Policy>
+    void watch(decay_ptr<T, Policy>& ptr)
+    {
+        std::shared_ptr<const handle> watched = m_handle;
+        ptr.on_decay([watched] { watched->signal(); });
+    }
+
+    /**
+     * Become readable whenever a member of set decays, see
+     * decay_set::on_ready(). Members that decayed before this was called
+     * don't signal it, so check set.take_decayed() after watching.
+     */
+    template <typename T>
+    void watch(decay_set<T>& set)
+    {
+        std::shared_ptr<const handle> watched = m_handle;
+        set.on_ready([watched] { watched->signal(); });
+    }
+
+    /** Make the descriptor readable. */
+    void signal()
+    {
+        m_handle->signal();
+    }
+
+    /**
+     * Drain the descriptor so that it is no longer readable, returning
+     * whether it was. Call this before handling the decays that woke the
+     * loop, so that decays which come in meanwhile signal it again.
+     */
+    bool reset()
+    {
+        return m_handle->reset();
+    }
+
+private:
+    std::shared_ptr<const handle> m_handle;
+};
+
+#endif // BITCOIN_DECAYFD_H
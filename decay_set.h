@@ -0,0 +1,199 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_DECAYSET_H
+#define BITCOIN_DECAYSET_H
+
+#include "strong_ptr.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Waits for many decay_ptrs at once. Each member's decay callback records
+ * it as ready and signals a single condition variable shared by the whole
+ * set, so waiting never touches the members' own wake states, and finding
+ * the decayed members doesn't mean scanning all of them.
+ *
+ * A set belongs to one thread: only the callbacks that run on decay are
+ * synchronized with it. Adding a decay_ptr uses its on_decay() slot.
+ */
+template <typename T>
+class decay_set
+{
+    // What the decay callbacks share with the set, and outlives it if they
+    // haven't all run by the time it goes away.
+    struct signal {
+        void ready(std::size_t index)
+        {
+            bool wake;
+            std::shared_ptr<const std::function<void()>> on_ready;
+            {
+                std::lock_guard<std::mutex> lock(m_mut);
+                m_ready.push_back(index);
+                wake = m_waiting;
+                on_ready = m_on_ready;
+            }
+            if (wake) m_cond.notify_one();
+            if (on_ready) (*on_ready)();
+        }
+        std::mutex m_mut;
+        std::condition_variable m_cond;
+        std::vector<std::size_t> m_ready;
+        std::shared_ptr<const std::function<void()>> m_on_ready;
+        bool m_waiting{false};
+    };
+
+public:
+    decay_set() : m_signal{std::make_shared<signal>()} {}
+
+    decay_set(const decay_set&) = delete;
+    decay_set& operator=(const decay_set&) = delete;
+
+    /** Add ptr, which must not have a decay callback yet. Null pointers are ready right away. */
+    void add(decay_ptr<T>&& ptr)
+    {
+        std::size_t index;
+        if (m_free.empty()) {
+            index = m_members.size();
+            m_members.emplace_back();
+        } else {
+            index = m_free.back();
+            m_free.pop_back();
+        }
+        ++m_size;
+        // The callback may run right away, but only touches the signal.
+        ptr.on_decay([signal = m_signal, index] { signal->ready(index); });
+        m_members[index] = std::move(ptr);
+    }
+
+    /** The members that haven't been taken out of the set. */
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    /** Remove and return the members that have decayed so far, without blocking. */
+    std::vector<decay_ptr<T>> take_decayed()
+    {
+        std::vector<std::size_t> ready;
+        {
+            std::lock_guard<std::mutex> lock(m_signal->m_mut);
+            ready.swap(m_signal->m_ready);
+        }
+        std::vector<decay_ptr<T>> decayed;
+        decayed.reserve(ready.size());
+        for (std::size_t index : ready) {
+            decayed.push_back(std::move(m_members[index]));
+            m_free.push_back(index);
+        }
+        m_size -= ready.size();
+        return decayed;
+    }
+
+    /**
+     * Block until at least one member has decayed, then remove and return
+     * all of those that have. Returns nothing if the set is empty.
+     */
+    std::vector<decay_ptr<T>> wait_any()
+    {
+        if (!empty()) wait_ready(1);
+        return take_decayed();
+    }
+    template <class Rep, class Period>
+    std::vector<decay_ptr<T>> wait_any_for(const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return wait_any_until(std::chrono::steady_clock::now() + rel_time);
+    }
+    /** Like wait_any(), returning nothing if no member decays by timeout_time. */
+    template <class Clock, class Duration>
+    std::vector<decay_ptr<T>> wait_any_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        if (!empty()) wait_ready_until(1, timeout_time);
+        return take_decayed();
+    }
+
+    /** Block until every member has decayed. The members stay in the set. */
+    void wait_all()
+    {
+        wait_ready(m_size);
+    }
+    template <class Rep, class Period>
+    bool wait_all_for(const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return wait_all_until(std::chrono::steady_clock::now() + rel_time);
+    }
+    /** Like wait_all(), returning false if not every member has decayed by timeout_time. */
+    template <class Clock, class Duration>
+    bool wait_all_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        return wait_ready_until(m_size, timeout_time);
+    }
+
+    /**
+     * Also call on_ready whenever a member decays, on the thread decaying
+     * it, e.g. to wake up an event loop, see decay_fd. Members that decayed
+     * before this was set don't call it. Pass nullptr to stop.
+     */
+    void on_ready(std::function<void()> on_ready)
+    {
+        std::shared_ptr<const std::function<void()>> callback;
+        if (on_ready) callback = std::make_shared<const std::function<void()>>(std::move(on_ready));
+        std::lock_guard<std::mutex> lock(m_signal->m_mut);
+        m_signal->m_on_ready.swap(callback);
+    }
+
+    /** Remove all members, decayed or not. */
+    void clear()
+    {
+        std::vector<decay_ptr<T>> members;
+        members.swap(m_members);
+        m_free.clear();
+        m_size = 0;
+        // Callbacks for the old members may still come in; start over.
+        std::shared_ptr<signal> fresh = std::make_shared<signal>();
+        {
+            std::lock_guard<std::mutex> lock(m_signal->m_mut);
+            fresh->m_on_ready = std::move(m_signal->m_on_ready);
+        }
+        m_signal = std::move(fresh);
+    }
+
+private:
+    void wait_ready(std::size_t count)
+    {
+        if (count == 0) return;
+        std::unique_lock<std::mutex> lock(m_signal->m_mut);
+        m_signal->m_waiting = true;
+        m_signal->m_cond.wait(lock, [&] { return m_signal->m_ready.size() >= count; });
+        m_signal->m_waiting = false;
+    }
+    template <class Clock, class Duration>
+    bool wait_ready_until(std::size_t count, const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        if (count == 0) return true;
+        std::unique_lock<std::mutex> lock(m_signal->m_mut);
+        m_signal->m_waiting = true;
+        const bool ready = m_signal->m_cond.wait_until(lock, timeout_time, [&] { return m_signal->m_ready.size() >= count; });
+        m_signal->m_waiting = false;
+        return ready;
+    }
+
+    std::shared_ptr<signal> m_signal;
+    std::vector<decay_ptr<T>> m_members;
+    std::vector<std::size_t> m_free;
+    std::size_t m_size{0};
+};
+
+#endif // BITCOIN_DECAYSET_H
@@ -0,0 +1,434 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INTRUSIVE_STRONGPTR_H
+#define BITCOIN_INTRUSIVE_STRONGPTR_H
+
+#include "strong_ptr.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+template <typename T>
+class intrusive_strong_ptr;
+
+template <typename T>
+class intrusive_loan;
+
+template <typename T>
+class intrusive_decay_ptr;
+
+/**
+ * Base class for objects managed by intrusive_strong_ptr. The loan count and
+ * the decay and wake state live in the object itself, so no extra allocation
+ * is needed, and the owner, its loans and its decay_ptr are all a single
+ * pointer to the object.
+ *
+ * m_loans counts the loans plus one for the owner, and reaching zero is the
+ * moment of decay, as with strong_ptr. m_refs counts the decay_ptr plus one
+ * while there are loans, and the object is deleted (through the virtual
+ * destructor) when that reaches zero.
+ *
+ * Copying an object does not copy its hook: the copy starts out unowned.
+ */
+class strong_ptr_hook : private strong_decay_state
+{
+    template <typename T>
+    friend class intrusive_strong_ptr;
+
+    template <typename T>
+    friend class intrusive_loan;
+
+    template <typename T>
+    friend class intrusive_decay_ptr;
+
+public:
+    strong_ptr_hook() noexcept = default;
+    strong_ptr_hook(const strong_ptr_hook&) noexcept : strong_ptr_hook() {}
+    strong_ptr_hook& operator=(const strong_ptr_hook&) noexcept
+    {
+        return *this;
+    }
+
+    virtual ~strong_ptr_hook()
+    {
+        release_wake();
+    }
+
+private:
+    void release_owner()
+    {
+        // Without loans, nobody else can reach the object, let alone wait
+        // for it, so it can be deleted straight away.
+        if (m_loans.load(std::memory_order_acquire) == 1) {
+            delete this;
+        } else {
+            release_loan();
+        }
+    }
+    void add_loan()
+    {
+        m_loans.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release_loan()
+    {
+        if (m_loans.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            notify_decayed();
+            release_ref();
+        }
+    }
+    void add_ref()
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release_ref()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    std::atomic<std::size_t> m_loans{1};
+    std::atomic<std::size_t> m_refs{1};
+};
+
+/**
+ * Like strong_ptr, for objects deriving from strong_ptr_hook. Loans are
+ * intrusive_loan rather than std::shared_ptr, and it decays into an
+ * intrusive_decay_ptr.
+ */
+template <typename T>
+class intrusive_strong_ptr
+{
+    static_assert(std::is_base_of<strong_ptr_hook, T>::value, "T must derive from strong_ptr_hook");
+
+    template <typename U>
+    friend class intrusive_strong_ptr;
+
+    template <typename U>
+    friend class intrusive_decay_ptr;
+
+public:
+    using element_type = T;
+
+    constexpr intrusive_strong_ptr() noexcept = default;
+    constexpr intrusive_strong_ptr(std::nullptr_t) noexcept {}
+
+    /** Take ownership of ptr, which must not be owned already. */
+    explicit intrusive_strong_ptr(T* ptr) noexcept : m_ptr{ptr} {}
+
+    intrusive_strong_ptr(intrusive_strong_ptr&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)} {}
+
+    template <typename U>
+    intrusive_strong_ptr(intrusive_strong_ptr<U>&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)}
+    {
+    }
+
+    intrusive_strong_ptr(const intrusive_strong_ptr&) = delete;
+    intrusive_strong_ptr& operator=(const intrusive_strong_ptr&) = delete;
+
+    ~intrusive_strong_ptr()
+    {
+        if (m_ptr) hook()->release_owner();
+    }
+
+    intrusive_strong_ptr& operator=(intrusive_strong_ptr&& rhs) noexcept
+    {
+        intrusive_strong_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    template <typename U>
+    intrusive_strong_ptr& operator=(intrusive_strong_ptr<U>&& rhs) noexcept
+    {
+        intrusive_strong_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(intrusive_strong_ptr& rhs) noexcept
+    {
+        std::swap(m_ptr, rhs.m_ptr);
+    }
+
+    void reset()
+    {
+        intrusive_strong_ptr().swap(*this);
+    }
+    void reset(T* ptr)
+    {
+        intrusive_strong_ptr(ptr).swap(*this);
+    }
+
+    intrusive_loan<T> get_shared() const
+    {
+        return intrusive_loan<T>(m_ptr);
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_ptr_hook* hook() const
+    {
+        return m_ptr;
+    }
+
+    T* m_ptr{nullptr};
+};
+
+/** A loan of an object owned by an intrusive_strong_ptr. */
+template <typename T>
+class intrusive_loan
+{
+    template <typename U>
+    friend class intrusive_loan;
+
+    template <typename U>
+    friend class intrusive_strong_ptr;
+
+    explicit intrusive_loan(T* ptr) noexcept : m_ptr{ptr}
+    {
+        if (m_ptr) hook()->add_loan();
+    }
+
+public:
+    using element_type = T;
+
+    constexpr intrusive_loan() noexcept = default;
+    constexpr intrusive_loan(std::nullptr_t) noexcept {}
+
+    intrusive_loan(const intrusive_loan& rhs) noexcept : intrusive_loan(rhs.m_ptr) {}
+    intrusive_loan(intrusive_loan&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)} {}
+
+    template <typename U>
+    intrusive_loan(const intrusive_loan<U>& rhs) noexcept : intrusive_loan(static_cast<T*>(rhs.m_ptr))
+    {
+    }
+    template <typename U>
+    intrusive_loan(intrusive_loan<U>&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)}
+    {
+    }
+
+    intrusive_loan& operator=(intrusive_loan rhs) noexcept
+    {
+        rhs.swap(*this);
+        return *this;
+    }
+
+    ~intrusive_loan()
+    {
+        if (m_ptr) hook()->release_loan();
+    }
+
+    void swap(intrusive_loan& rhs) noexcept
+    {
+        std::swap(m_ptr, rhs.m_ptr);
+    }
+
+    void reset()
+    {
+        intrusive_loan().swap(*this);
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_ptr_hook* hook() const
+    {
+        return m_ptr;
+    }
+
+    T* m_ptr{nullptr};
+};
+
+/**
+ * Like decay_ptr, for an intrusive_strong_ptr. The waits behave the same as
+ * those of decay_ptr.
+ */
+template <typename T>
+class intrusive_decay_ptr
+{
+    template <typename U>
+    friend class intrusive_decay_ptr;
+
+public:
+    using element_type = T;
+
+    constexpr intrusive_decay_ptr() noexcept = default;
+    constexpr intrusive_decay_ptr(std::nullptr_t) noexcept {}
+
+    intrusive_decay_ptr(intrusive_decay_ptr&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)} {}
+
+    template <typename U>
+    intrusive_decay_ptr(intrusive_decay_ptr<U>&& rhs) noexcept : m_ptr{std::exchange(rhs.m_ptr, nullptr)}
+    {
+    }
+
+    template <typename U>
+    intrusive_decay_ptr(intrusive_strong_ptr<U>&& ptr) : m_ptr{std::exchange(ptr.m_ptr, nullptr)}
+    {
+        if (m_ptr) {
+            hook()->add_ref();
+            hook()->release_loan();
+        }
+    }
+
+    intrusive_decay_ptr(const intrusive_decay_ptr&) = delete;
+    intrusive_decay_ptr& operator=(const intrusive_decay_ptr&) = delete;
+
+    ~intrusive_decay_ptr()
+    {
+        if (m_ptr) hook()->release_ref();
+    }
+
+    intrusive_decay_ptr& operator=(intrusive_decay_ptr&& rhs) noexcept
+    {
+        intrusive_decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    template <typename U>
+    intrusive_decay_ptr& operator=(intrusive_decay_ptr<U>&& rhs) noexcept
+    {
+        intrusive_decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    template <typename U>
+    intrusive_decay_ptr& operator=(intrusive_strong_ptr<U>&& rhs)
+    {
+        intrusive_decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(intrusive_decay_ptr& rhs) noexcept
+    {
+        std::swap(m_ptr, rhs.m_ptr);
+    }
+
+    void reset()
+    {
+        intrusive_decay_ptr().swap(*this);
+    }
+
+    bool decayed() const
+    {
+        return !m_ptr || hook()->decayed();
+    }
+
+    void wait()
+    {
+        if (m_ptr) hook()->wait_decayed();
+    }
+
+    /** Spin as described by policy, then block if still not decayed. */
+    void wait(const spin_then_block& policy)
+    {
+        if (!policy.spin([this] { return decayed(); })) wait();
+    }
+
+    template <class Predicate>
+    void wait(Predicate stop_waiting)
+    {
+        if (m_ptr) hook()->wait(stop_waiting);
+    }
+
+    template <class Rep, class Period, class Predicate>
+    bool wait_for(const std::chrono::duration<Rep, Period>& rel_time, Predicate stop_waiting)
+    {
+        if (!m_ptr) return stop_waiting();
+        return hook()->wait_for(rel_time, stop_waiting);
+    }
+
+    template <class Rep, class Period>
+    std::cv_status wait_for(const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return wait_for(rel_time, [this] { return decayed(); }) ? std::cv_status::no_timeout : std::cv_status::timeout;
+    }
+
+    template <class Clock, class Duration, class Predicate>
+    bool wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time, Predicate stop_waiting)
+    {
+        if (!m_ptr) return stop_waiting();
+        return hook()->wait_until(timeout_time, stop_waiting);
+    }
+
+    template <class Clock, class Duration>
+    std::cv_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        return wait_until(timeout_time, [this] { return decayed(); }) ? std::cv_status::no_timeout : std::cv_status::timeout;
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_ptr_hook* hook() const
+    {
+        return m_ptr;
+    }
+
+    T* m_ptr{nullptr};
+};
+
+static_assert(sizeof(intrusive_strong_ptr<strong_ptr_hook>) == sizeof(void*), "intrusive_strong_ptr should be one pointer wide");
+static_assert(sizeof(intrusive_loan<strong_ptr_hook>) == sizeof(void*), "intrusive_loan should be one pointer wide");
+static_assert(sizeof(intrusive_decay_ptr<strong_ptr_hook>) == sizeof(void*), "intrusive_decay_ptr should be one pointer wide");
+
+/** Create an intrusive_strong_ptr holding a T constructed from args, with a single plain new. */
+template <typename T, typename... Args>
+inline intrusive_strong_ptr<T> make_intrusive_strong(Args&&... args)
+{
+    return intrusive_strong_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+#endif // BITCOIN_INTRUSIVE_STRONGPTR_H
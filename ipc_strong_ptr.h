@@ -0,0 +1,404 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_IPCSTRONGPTR_H
+#define BITCOIN_IPCSTRONGPTR_H
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__linux__)
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "ipc_strong_ptr needs address-free atomics");
+
+/**
+ * The bookkeeping at the start of a shared memory segment holding an object
+ * owned by an ipc_strong_ptr. Everything in it is position independent: the
+ * object is found at m_offset from the header, wherever each process maps
+ * the segment.
+ *
+ * m_count holds owner_bit while the owner holds the object, and counts the
+ * loans of all processes in its low bits. Reaching zero is the decay. While
+ * the owner waits for that, it sets waiting_bit, and sleeps on the word with
+ * a (process shared) futex, so that whoever releases the last loan knows to
+ * wake it.
+ */
+struct ipc_strong_header
+{
+    static constexpr std::uint32_t owner_bit = std::uint32_t(1) << 31;
+    static constexpr std::uint32_t waiting_bit = std::uint32_t(1) << 30;
+    static constexpr std::uint32_t loan_mask = waiting_bit - 1;
+    static constexpr std::uint32_t magic = 0x5354524e;
+
+    static bool decayed(std::uint32_t count)
+    {
+        return !(count & (owner_bit | loan_mask));
+    }
+
+    /** Take a loan, unless the owner has let go. */
+    bool try_add_loan()
+    {
+        std::uint32_t count = m_count.load(std::memory_order_relaxed);
+        while (count & owner_bit) {
+            assert((count & loan_mask) != loan_mask);
+            if (m_count.compare_exchange_weak(count, count + 1, std::memory_order_acquire, std::memory_order_relaxed)) return true;
+        }
+        return false;
+    }
+    /** Take another loan while already holding one. */
+    void add_loan()
+    {
+        m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release(std::uint32_t amount)
+    {
+        const std::uint32_t count = m_count.fetch_sub(amount, std::memory_order_acq_rel) - amount;
+        if (decayed(count) && (count & waiting_bit)) wake();
+    }
+
+    bool is_decayed() const
+    {
+        return decayed(m_count.load(std::memory_order_acquire));
+    }
+
+    /** Wait until decayed or until deadline, returning whether it has decayed. */
+    template <typename Clock, typename Duration>
+    bool wait_until(const std::chrono::time_point<Clock, Duration>* deadline)
+    {
+        std::uint32_t count = m_count.load(std::memory_order_acquire);
+        while (!decayed(count)) {
+            if (!(count & waiting_bit)) {
+                if (!m_count.compare_exchange_weak(count, count | waiting_bit, std::memory_order_acq_rel, std::memory_order_acquire)) continue;
+                count |= waiting_bit;
+            }
+            if (deadline && Clock::now() >= *deadline) return false;
+            sleep(count, deadline);
+            count = m_count.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+
+#if defined(__linux__)
+    std::uint32_t* word()
+    {
+        return reinterpret_cast<std::uint32_t*>(&m_count);
+    }
+    template <typename Clock, typename Duration>
+    void sleep(std::uint32_t count, const std::chrono::time_point<Clock, Duration>* deadline)
+    {
+        timespec rel{};
+        if (deadline) {
+            const auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(*deadline - Clock::now());
+            if (left.count() <= 0) return;
+            rel.tv_sec = static_cast<std::time_t>(left.count() / 1000000000);
+            rel.tv_nsec = static_cast<long>(left.count() % 1000000000);
+        }
+        ::syscall(SYS_futex, word(), FUTEX_WAIT, count, deadline ? &rel : nullptr, nullptr, 0);
+    }
+    void wake()
+    {
+        ::syscall(SYS_futex, word(), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+#else
+    // Without a process shared futex, waiters poll.
+    template <typename Clock, typename Duration>
+    void sleep(std::uint32_t, const std::chrono::time_point<Clock, Duration>*)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    void wake() {}
+#endif
+
+    std::atomic<std::uint32_t> m_count;
+    std::uint32_t m_magic;
+    std::uint64_t m_offset;
+    std::uint64_t m_size;
+};
+
+template <typename T>
+class ipc_loan;
+
+template <typename T>
+class ipc_decay_ptr;
+
+/**
+ * Like strong_ptr, for an object living in a shared memory segment, so that
+ * other processes mapping the segment can take loans of it, see
+ * ipc_loan<T>::take(). The owner's ipc_decay_ptr decays once every loan, in
+ * any process, has been released, after which the segment may be reused.
+ *
+ * The object must be usable from any process, so it can't hold pointers
+ * outside the segment, and it must be trivially destructible: it is never
+ * destroyed, the segment is simply reused or unmapped. The segment belongs
+ * to the caller, and must outlive every pointer and loan referring to it. A
+ * process that exits while holding loans keeps the object from decaying.
+ */
+template <typename T>
+class ipc_strong_ptr
+{
+    static_assert(std::is_trivially_destructible<T>::value, "objects in shared memory are never destroyed");
+
+    template <typename U>
+    friend class ipc_decay_ptr;
+
+    template <typename U, typename... Args>
+    friend ipc_strong_ptr<U> make_ipc_strong(void* segment, std::size_t size, Args&&... args);
+
+    explicit ipc_strong_ptr(ipc_strong_header* header) noexcept : m_header{header} {}
+
+public:
+    using element_type = T;
+
+    constexpr ipc_strong_ptr() noexcept = default;
+    ipc_strong_ptr(ipc_strong_ptr&& rhs) noexcept : m_header{std::exchange(rhs.m_header, nullptr)} {}
+    ipc_strong_ptr(const ipc_strong_ptr&) = delete;
+    ipc_strong_ptr& operator=(const ipc_strong_ptr&) = delete;
+
+    ~ipc_strong_ptr()
+    {
+        if (m_header) m_header->release(ipc_strong_header::owner_bit);
+    }
+
+    ipc_strong_ptr& operator=(ipc_strong_ptr&& rhs) noexcept
+    {
+        ipc_strong_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(ipc_strong_ptr& rhs) noexcept
+    {
+        std::swap(m_header, rhs.m_header);
+    }
+
+    void reset()
+    {
+        ipc_strong_ptr().swap(*this);
+    }
+
+    /** A loan of the object, for use in this process. */
+    ipc_loan<T> get_shared() const
+    {
+        if (!m_header) return ipc_loan<T>();
+        m_header->add_loan();
+        return ipc_loan<T>(m_header);
+    }
+
+    T& operator*() const
+    {
+        return *get();
+    }
+    T* operator->() const
+    {
+        return get();
+    }
+    T* get() const
+    {
+        return m_header ? ipc_loan<T>::object(m_header) : nullptr;
+    }
+    explicit operator bool() const
+    {
+        return m_header != nullptr;
+    }
+
+private:
+    ipc_strong_header* m_header{nullptr};
+};
+
+/**
+ * A loan of an object owned by an ipc_strong_ptr, in this process' mapping
+ * of its segment. Like the object, it must only be used within this process.
+ */
+template <typename T>
+class ipc_loan
+{
+    template <typename U>
+    friend class ipc_strong_ptr;
+
+    template <typename U>
+    friend class ipc_decay_ptr;
+
+    explicit ipc_loan(ipc_strong_header* header) noexcept : m_header{header} {}
+
+    static T* object(ipc_strong_header* header)
+    {
+        return reinterpret_cast<T*>(reinterpret_cast<unsigned char*>(header) + header->m_offset);
+    }
+
+public:
+    using element_type = T;
+
+    constexpr ipc_loan() noexcept = default;
+    ipc_loan(const ipc_loan& rhs) noexcept : m_header{rhs.m_header}
+    {
+        if (m_header) m_header->add_loan();
+    }
+    ipc_loan(ipc_loan&& rhs) noexcept : m_header{std::exchange(rhs.m_header, nullptr)} {}
+
+    ipc_loan& operator=(ipc_loan rhs) noexcept
+    {
+        rhs.swap(*this);
+        return *this;
+    }
+
+    ~ipc_loan()
+    {
+        if (m_header) m_header->release(1);
+    }
+
+    /**
+     * Take a loan of the object at the start of segment, as mapped into
+     * this process, once make_ipc_strong() has set it up. Returns null if
+     * the segment doesn't hold a T, or if its owner has let go of it.
+     */
+    static ipc_loan take(void* segment)
+    {
+        ipc_strong_header* header = static_cast<ipc_strong_header*>(segment);
+        if (header->m_magic != ipc_strong_header::magic || header->m_size != sizeof(T)) return ipc_loan();
+        if (!header->try_add_loan()) return ipc_loan();
+        return ipc_loan(header);
+    }
+
+    void swap(ipc_loan& rhs) noexcept
+    {
+        std::swap(m_header, rhs.m_header);
+    }
+
+    void reset()
+    {
+        ipc_loan().swap(*this);
+    }
+
+    T& operator*() const
+    {
+        return *get();
+    }
+    T* operator->() const
+    {
+        return get();
+    }
+    T* get() const
+    {
+        return m_header ? object(m_header) : nullptr;
+    }
+    explicit operator bool() const
+    {
+        return m_header != nullptr;
+    }
+
+private:
+    ipc_strong_header* m_header{nullptr};
+};
+
+/**
+ * What an ipc_strong_ptr decays into. Once it has decayed, no process holds
+ * a loan of the object anymore, nor can take a new one.
+ */
+template <typename T>
+class ipc_decay_ptr
+{
+public:
+    using element_type = T;
+
+    constexpr ipc_decay_ptr() noexcept = default;
+    ipc_decay_ptr(ipc_decay_ptr&& rhs) noexcept : m_header{std::exchange(rhs.m_header, nullptr)} {}
+    ipc_decay_ptr(ipc_strong_ptr<T>&& ptr) : m_header{std::exchange(ptr.m_header, nullptr)}
+    {
+        if (m_header) m_header->release(ipc_strong_header::owner_bit);
+    }
+    ipc_decay_ptr(const ipc_decay_ptr&) = delete;
+    ipc_decay_ptr& operator=(const ipc_decay_ptr&) = delete;
+
+    ipc_decay_ptr& operator=(ipc_decay_ptr&& rhs) noexcept
+    {
+        ipc_decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(ipc_decay_ptr& rhs) noexcept
+    {
+        std::swap(m_header, rhs.m_header);
+    }
+
+    void reset()
+    {
+        ipc_decay_ptr().swap(*this);
+    }
+
+    bool decayed() const
+    {
+        return !m_header || m_header->is_decayed();
+    }
+
+    void wait()
+    {
+        if (m_header) m_header->wait_until(static_cast<const std::chrono::steady_clock::time_point*>(nullptr));
+    }
+    template <class Rep, class Period>
+    std::cv_status wait_for(const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return wait_until(std::chrono::steady_clock::now() + rel_time);
+    }
+    template <class Clock, class Duration>
+    std::cv_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        if (!m_header || m_header->wait_until(&timeout_time)) return std::cv_status::no_timeout;
+        return std::cv_status::timeout;
+    }
+
+    T& operator*() const
+    {
+        return *get();
+    }
+    T* operator->() const
+    {
+        return get();
+    }
+    T* get() const
+    {
+        return m_header ? ipc_loan<T>::object(m_header) : nullptr;
+    }
+    explicit operator bool() const
+    {
+        return m_header != nullptr;
+    }
+
+private:
+    ipc_strong_header* m_header{nullptr};
+};
+
+/**
+ * Construct a T from args in segment, a shared memory mapping of size bytes
+ * aligned for ipc_strong_header, behind the bookkeeping, and own it. Throws
+ * std::bad_alloc if it doesn't fit.
+ */
+template <typename T, typename... Args>
+ipc_strong_ptr<T> make_ipc_strong(void* segment, std::size_t size, Args&&... args)
+{
+    assert(reinterpret_cast<std::uintptr_t>(segment) % alignof(ipc_strong_header) == 0);
+    const std::size_t offset = (sizeof(ipc_strong_header) + alignof(T) - 1) / alignof(T) * alignof(T);
+    if (size < offset + sizeof(T)) throw std::bad_alloc();
+    ::new (static_cast<unsigned char*>(segment) + offset) T(std::forward<Args>(args)...);
+    ipc_strong_header* header = ::new (segment) ipc_strong_header{};
+    header->m_offset = offset;
+    header->m_size = sizeof(T);
+    header->m_magic = ipc_strong_header::magic;
+    // Publishes the rest of the header and the object to loans taken after this.
+    header->m_count.store(ipc_strong_header::owner_bit, std::memory_order_release);
+    return ipc_strong_ptr<T>(header);
+}
+
+#endif // BITCOIN_IPCSTRONGPTR_H
@@ -0,0 +1,411 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NUMASTRONGPTR_H
+#define BITCOIN_NUMASTRONGPTR_H
+
+#include "strong_ptr.h"
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Which memory node each cpu belongs to, as reported by sysfs. Machines
+ * without NUMA, and platforms other than Linux, look like a single node.
+ */
+class strong_numa_topology
+{
+public:
+    static const strong_numa_topology& get()
+    {
+        static const strong_numa_topology topology;
+        return topology;
+    }
+
+    /** One more than the highest node number. */
+    unsigned nodes() const
+    {
+        return m_nodes;
+    }
+
+    /** The node of the cpu the calling thread is running on. */
+    unsigned current_node() const
+    {
+#if defined(__linux__)
+        // sched_getcpu() goes through the vdso, where getcpu() may not.
+        const int cpu = ::sched_getcpu();
+        if (cpu >= 0 && static_cast<std::size_t>(cpu) < m_cpu_nodes.size()) return m_cpu_nodes[cpu];
+#endif
+        return 0;
+    }
+
+private:
+    strong_numa_topology()
+    {
+#if defined(__linux__)
+        std::vector<unsigned> online = parse_list(read_line("/sys/devices/system/node/online"));
+        for (unsigned node : online) {
+            if (node >= m_nodes) m_nodes = node + 1;
+            for (unsigned cpu : parse_list(read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))) {
+                if (cpu >= m_cpu_nodes.size()) m_cpu_nodes.resize(cpu + 1, 0);
+                m_cpu_nodes[cpu] = node;
+            }
+        }
+#endif
+    }
+
+    static std::string read_line(const std::string& path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    // Parses sysfs lists such as "0-3,8-11".
+    static std::vector<unsigned> parse_list(const std::string& list)
+    {
+        std::vector<unsigned> values;
+        std::size_t pos = 0;
+        while (pos < list.size()) {
+            std::size_t end;
+            unsigned first, last;
+            try {
+                first = last = static_cast<unsigned>(std::stoul(list.substr(pos), &end));
+                pos += end;
+                if (pos < list.size() && list[pos] == '-') {
+                    ++pos;
+                    last = static_cast<unsigned>(std::stoul(list.substr(pos), &end));
+                    pos += end;
+                }
+            } catch (const std::exception&) {
+                break;
+            }
+            for (unsigned value = first; value <= last; ++value) {
+                values.push_back(value);
+            }
+            if (pos < list.size() && list[pos] == ',') ++pos;
+        }
+        return values;
+    }
+
+    unsigned m_nodes{1};
+    std::vector<unsigned> m_cpu_nodes;
+};
+
+/** The memory node of the calling thread's cpu. */
+inline unsigned strong_numa_node()
+{
+    return strong_numa_topology::get().current_node();
+}
+
+/**
+ * An allocator placing its memory on a given node. Each allocation is
+ * mapped in whole pages and bound to the node before anything touches it,
+ * so this is meant for a modest number of long-lived, read-heavy objects,
+ * not for everything. Every allocation costs at least a page, and a
+ * strong_ptr using this allocator makes more than one: besides the object
+ * and its bookkeeping, the state for waiting on its decay is allocated
+ * when first needed, and each rearm() may take another control block. The
+ * binding is a preference: if the node runs out of
+ * memory, or can't be bound to, the kernel places the pages elsewhere.
+ */
+template <typename V>
+struct strong_numa_allocator
+{
+    using value_type = V;
+
+    explicit strong_numa_allocator(unsigned node) noexcept : m_node{node} {}
+    template <typename U>
+    strong_numa_allocator(const strong_numa_allocator<U>& rhs) noexcept : m_node{rhs.m_node}
+    {
+    }
+
+    V* allocate(std::size_t n)
+    {
+#if defined(__linux__)
+        const std::size_t bytes = pages(n * sizeof(V));
+        void* ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) throw std::bad_alloc();
+        bind(ptr, bytes);
+        return static_cast<V*>(ptr);
+#else
+        // Without a way to place memory, fall back to the heap.
+        if (alignof(V) > alignof(std::max_align_t)) throw std::bad_alloc();
+        return static_cast<V*>(::operator new(n * sizeof(V)));
+#endif
+    }
+    void deallocate(V* ptr, std::size_t n)
+    {
+#if defined(__linux__)
+        ::munmap(ptr, pages(n * sizeof(V)));
+#else
+        ::operator delete(ptr);
+#endif
+    }
+
+    template <typename U>
+    bool operator==(const strong_numa_allocator<U>& rhs) const
+    {
+        return m_node == rhs.m_node;
+    }
+    template <typename U>
+    bool operator!=(const strong_numa_allocator<U>& rhs) const
+    {
+        return m_node != rhs.m_node;
+    }
+
+    unsigned m_node;
+
+private:
+#if defined(__linux__)
+    static std::size_t pages(std::size_t bytes)
+    {
+        static const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        return (bytes + page - 1) / page * page;
+    }
+
+    void bind(void* ptr, std::size_t bytes) const
+    {
+#if defined(SYS_mbind)
+        // mbind() itself lives in libnuma; the syscall doesn't need it.
+        constexpr int mpol_preferred = 1;
+        constexpr std::size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(m_node / bits + 1, 0);
+        mask[m_node / bits] = 1UL << (m_node % bits);
+        ::syscall(SYS_mbind, ptr, bytes, mpol_preferred, mask.data(), mask.size() * bits + 1, 0);
+#else
+        (void)ptr;
+        (void)bytes;
+#endif
+    }
+#endif
+};
+
+/** Like make_strong(), with the object and its bookkeeping placed on node. */
+template <typename T, typename... Args>
+inline strong_ptr<T> make_strong_on_node(unsigned node, Args&&... args)
+{
+    return allocate_strong<T>(strong_numa_allocator<T>(node), std::forward<Args>(args)...);
+}
+
+/** Like make_strong(), with the object placed on the calling thread's node. */
+template <typename T, typename... Args>
+inline strong_ptr<T> make_strong_local(Args&&... args)
+{
+    return make_strong_on_node<T>(strong_numa_node(), std::forward<Args>(args)...);
+}
+
+template <typename T>
+class replicated_decay_ptr;
+
+/**
+ * An immutable object with a copy on every memory node, so that readers
+ * always take their loans of, and read from, the copy on their own node.
+ * get_shared() only gives const access: the copies are never synchronized,
+ * so they must not change after construction.
+ *
+ * T must be trivially copyable, and self-contained: a copy only lands on
+ * its node if all of it lives in the object itself. Anything T points to,
+ * like the elements of a std::vector, would stay wherever the first copy
+ * put it, and every node would read it from there.
+ *
+ * Each copy is a strong_ptr of its own. Moving the whole into a
+ * replicated_decay_ptr decays all of them, and it has decayed once the loans
+ * of every copy are gone.
+ */
+template <typename T>
+class replicated_strong_ptr
+{
+    static_assert(std::is_trivially_copyable<T>::value, "replicas are made by copying, and must not own memory elsewhere");
+
+public:
+    replicated_strong_ptr() = default;
+
+    replicated_strong_ptr(replicated_strong_ptr&&) noexcept = default;
+    replicated_strong_ptr& operator=(replicated_strong_ptr&&) noexcept = default;
+
+#if STRONG_PTR_INSTRUMENT >= 2
+    /** Take a loan of the copy on the calling thread's node. */
+    std::shared_ptr<const T> get_shared(strong_loan_site site = strong_loan_site::current()) const
+    {
+        return get_shared(strong_numa_node(), site);
+    }
+
+    /** Take a loan of the copy on node. */
+    std::shared_ptr<const T> get_shared(unsigned node, strong_loan_site site = strong_loan_site::current()) const
+    {
+        if (m_replicas.empty()) return nullptr;
+        return replica(node).get_shared(site);
+    }
+#else
+    /** Take a loan of the copy on the calling thread's node. */
+    std::shared_ptr<const T> get_shared() const
+    {
+        return get_shared(strong_numa_node());
+    }
+
+    /** Take a loan of the copy on node. */
+    std::shared_ptr<const T> get_shared(unsigned node) const
+    {
+        if (m_replicas.empty()) return nullptr;
+        return replica(node).get_shared();
+    }
+#endif
+
+    /** The copy on the calling thread's node. */
+    const T* get() const
+    {
+        if (m_replicas.empty()) return nullptr;
+        return replica(strong_numa_node()).get();
+    }
+
+    const T& operator*() const
+    {
+        assert(!m_replicas.empty());
+        return *get();
+    }
+
+    const T* operator->() const
+    {
+        return get();
+    }
+
+    explicit operator bool() const
+    {
+        return !m_replicas.empty();
+    }
+
+    /** The number of copies, one per node. */
+    std::size_t replicas() const
+    {
+        return m_replicas.size();
+    }
+
+    void reset()
+    {
+        m_replicas.clear();
+    }
+
+private:
+    friend class replicated_decay_ptr<T>;
+    template <typename U, typename... Args>
+    friend replicated_strong_ptr<U> make_replicated_strong(Args&&... args);
+
+    explicit replicated_strong_ptr(std::vector<strong_ptr<T>>&& replicas) : m_replicas{std::move(replicas)} {}
+
+    const strong_ptr<T>& replica(unsigned node) const
+    {
+        // Nodes that came online after construction use the first copy.
+        return m_replicas[node < m_replicas.size() ? node : 0];
+    }
+
+    std::vector<strong_ptr<T>> m_replicas;
+};
+
+/** A decay_ptr for all of the copies of a replicated_strong_ptr, see there. */
+template <typename T>
+class replicated_decay_ptr
+{
+public:
+    replicated_decay_ptr() = default;
+    explicit replicated_decay_ptr(replicated_strong_ptr<T>&& ptr)
+    {
+        m_replicas.reserve(ptr.m_replicas.size());
+        for (strong_ptr<T>& replica : ptr.m_replicas) {
+            m_replicas.emplace_back(std::move(replica));
+        }
+        ptr.m_replicas.clear();
+    }
+
+    replicated_decay_ptr(replicated_decay_ptr&&) noexcept = default;
+    replicated_decay_ptr& operator=(replicated_decay_ptr&&) noexcept = default;
+
+    /** Whether the loans of every copy are gone. */
+    bool decayed() const
+    {
+        for (const decay_ptr<T>& replica : m_replicas) {
+            if (!replica.decayed()) return false;
+        }
+        return true;
+    }
+
+    void wait()
+    {
+        for (decay_ptr<T>& replica : m_replicas) {
+            replica.wait();
+        }
+    }
+
+    template <class Rep, class Period>
+    std::cv_status wait_for(const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return wait_until(std::chrono::steady_clock::now() + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    std::cv_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
+    {
+        for (decay_ptr<T>& replica : m_replicas) {
+            if (replica.wait_until(timeout_time) == std::cv_status::timeout) return std::cv_status::timeout;
+        }
+        return std::cv_status::no_timeout;
+    }
+
+    /** The first copy. Only safe to access once decayed, like decay_ptr::get(). */
+    const T* get() const
+    {
+        return m_replicas.empty() ? nullptr : m_replicas.front().get();
+    }
+
+    explicit operator bool() const
+    {
+        return !m_replicas.empty();
+    }
+
+    /** Let go of every copy; those still on loan go with their last loan. */
+    void reset()
+    {
+        m_replicas.clear();
+    }
+
+private:
+    std::vector<decay_ptr<T>> m_replicas;
+};
+
+/**
+ * Like make_strong(), for a replicated_strong_ptr: the object is constructed
+ * from args on node 0, and copied from there to each of the other nodes.
+ */
+template <typename T, typename... Args>
+inline replicated_strong_ptr<T> make_replicated_strong(Args&&... args)
+{
+    const unsigned nodes = strong_numa_topology::get().nodes();
+    std::vector<strong_ptr<T>> replicas;
+    replicas.reserve(nodes);
+    replicas.push_back(make_strong_on_node<T>(0, std::forward<Args>(args)...));
+    for (unsigned node = 1; node < nodes; ++node) {
+        replicas.push_back(make_strong_on_node<T>(node, *replicas.front().get()));
+    }
+    return replicated_strong_ptr<T>(std::move(replicas));
+}
+
+#endif // BITCOIN_NUMASTRONGPTR_H
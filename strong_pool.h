@@ -0,0 +1,441 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRONGPOOL_H
+#define BITCOIN_STRONGPOOL_H
+
+#include "strong_ptr.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Fixed-size slots carved out of cache line aligned slabs, recycled through
+ * a lock-free freelist. The slot size is set by the first allocation; larger
+ * requests, and any made once max_slabs are in use, go to the heap (which
+ * can't serve alignments beyond std::max_align_t).
+ *
+ * The freelist is a stack of slot indices. Its head carries a tag that
+ * changes on every update, so that a slot popped and pushed back between a
+ * thread reading the head and swapping it can't be mistaken for an unchanged
+ * list. The links live next to the slab's slots rather than in them, so the
+ * objects stored in the slots are never read by other threads.
+ *
+ * Each thread keeps up to cached_slots slots it released for reuse, without
+ * touching the freelist, so that a thread making and dropping objects in a
+ * loop does so without atomic operations. A thread's cache only holds slots
+ * of one pool at a time: that of the first slot it releases into an empty
+ * cache. Cached slots go back to the freelist when the cache overflows, and
+ * when the thread exits; until then, other threads can't have them.
+ *
+ * To find the slab of a released slot without searching, memory is divided
+ * into cells of a power of two at least as large as a slab, and m_cells
+ * maps each cell that a slab overlaps (at most two) to that slab.
+ *
+ * Slabs are only ever added, under a mutex, and freed with the pool, which
+ * must outlive everything allocated from it.
+ */
+class strong_slab_pool
+{
+public:
+    static constexpr std::size_t line = 64;
+    static constexpr std::uint32_t cached_slots = 32;
+
+    strong_slab_pool(std::size_t slab_slots, std::size_t max_slabs) : m_slab_slots{slab_slots}, m_max_slabs{max_slabs}, m_slabs(new slab[max_slabs]), m_cell_mask{cell_table_size(max_slabs) - 1}, m_cells(new cell[m_cell_mask + 1])
+    {
+        assert(slab_slots > 0 && max_slabs > 0);
+        assert(slab_slots * max_slabs < index_mask);
+        std::lock_guard<std::mutex> lock(registry().m_mut);
+        registry().m_live.push_back(m_id);
+    }
+
+    strong_slab_pool(const strong_slab_pool&) = delete;
+    strong_slab_pool& operator=(const strong_slab_pool&) = delete;
+
+    ~strong_slab_pool()
+    {
+        {
+            // Threads exiting from now on drop what they cached of this.
+            std::lock_guard<std::mutex> lock(registry().m_mut);
+            std::vector<std::uint64_t>& live = registry().m_live;
+            for (std::size_t i = 0; i < live.size(); ++i) {
+                if (live[i] != m_id) continue;
+                live[i] = live.back();
+                live.pop_back();
+                break;
+            }
+        }
+        cache& local = local_cache();
+        if (local.m_pool == m_id) local.m_count = 0;
+        for (std::size_t i = 0; i < m_slab_count.load(std::memory_order_relaxed); ++i) {
+            ::operator delete(m_slabs[i].m_raw);
+        }
+    }
+
+    void* allocate(std::size_t bytes, std::size_t align)
+    {
+        if (align <= line && fits(bytes)) {
+            cache& local = local_cache();
+            if (local.m_pool == m_id && local.m_count != 0) return local.m_slots[--local.m_count];
+            std::uint32_t index = pop();
+            if (index == none) index = grow(bytes);
+            if (index != none) return slot(index);
+        }
+        if (align > alignof(std::max_align_t)) throw std::bad_alloc();
+        return ::operator new(bytes);
+    }
+
+    void deallocate(void* ptr, std::size_t bytes, std::size_t align)
+    {
+        if (align <= line && bytes <= m_slot_size.load(std::memory_order_relaxed)) {
+            if (owns(ptr)) {
+                release(ptr);
+                return;
+            }
+        }
+        ::operator delete(ptr);
+    }
+
+    /** The number of slots in all of the slabs allocated so far. */
+    std::size_t capacity() const
+    {
+        return m_slab_count.load(std::memory_order_acquire) * m_slab_slots;
+    }
+
+private:
+    static constexpr std::uint32_t none = 0xffffffff;
+    // The head of the freelist is a tag in the high half and the top slot's
+    // index plus one (zero when empty) in the low half.
+    static constexpr std::uint64_t index_mask = 0xffffffff;
+    static constexpr std::uint64_t tag_one = index_mask + 1;
+
+    struct slab {
+        void* m_raw{nullptr};
+        unsigned char* m_slots{nullptr};
+        std::atomic<std::uint32_t>* m_links{nullptr};
+    };
+
+    // A cell (plus one, zero when unused) and a slab overlapping it. Written
+    // under m_grow_mutex, m_slab before m_cell, and read without it.
+    struct cell {
+        std::atomic<std::uintptr_t> m_cell{0};
+        std::uint32_t m_slab{0};
+    };
+
+    struct cache {
+        std::uint64_t m_pool{0};
+        strong_slab_pool* m_owner{nullptr};
+        std::uint32_t m_count{0};
+        void* m_slots[cached_slots];
+
+        ~cache()
+        {
+            if (m_count == 0) return;
+            std::lock_guard<std::mutex> lock(registry().m_mut);
+            for (std::uint64_t live : registry().m_live) {
+                if (live == m_pool) {
+                    m_owner->push_slots(m_slots, m_count);
+                    break;
+                }
+            }
+        }
+    };
+
+    // The pools that exist, so that exiting threads know whether the slots
+    // they cached still have a pool to go back to. Ids are never reused.
+    struct pools {
+        std::mutex m_mut;
+        std::vector<std::uint64_t> m_live;
+        std::uint64_t m_next{1};
+    };
+    static pools& registry()
+    {
+        static pools p;
+        return p;
+    }
+    static std::uint64_t next_id()
+    {
+        std::lock_guard<std::mutex> lock(registry().m_mut);
+        return registry().m_next++;
+    }
+    static cache& local_cache()
+    {
+        static thread_local cache c;
+        return c;
+    }
+
+    static std::size_t cell_table_size(std::size_t max_slabs)
+    {
+        // Two cells per slab, with room to spare for probing.
+        std::size_t size = 1;
+        while (size < 4 * max_slabs) size <<= 1;
+        return size;
+    }
+    std::size_t cell_hash(std::uintptr_t c) const
+    {
+        return static_cast<std::size_t>(c * 0x9e3779b97f4a7c15ULL >> 32) & m_cell_mask;
+    }
+    void add_cell(std::uintptr_t c, std::uint32_t slab_index)
+    {
+        for (std::size_t i = cell_hash(c);; i = (i + 1) & m_cell_mask) {
+            cell& entry = m_cells[i];
+            if (entry.m_cell.load(std::memory_order_relaxed) != 0) continue;
+            entry.m_slab = slab_index;
+            entry.m_cell.store(c + 1, std::memory_order_release);
+            return;
+        }
+    }
+
+    /** Put a released slot in the thread's cache, or back on the freelist. */
+    void release(void* ptr)
+    {
+        cache& local = local_cache();
+        if (local.m_pool != m_id) {
+            if (local.m_count != 0) {
+                push_slots(&ptr, 1);
+                return;
+            }
+            local.m_pool = m_id;
+            local.m_owner = this;
+        }
+        if (local.m_count == cached_slots) {
+            // Hand back the older half, keeping the recently used slots.
+            const std::uint32_t half = cached_slots / 2;
+            push_slots(local.m_slots, half);
+            for (std::uint32_t i = half; i < cached_slots; ++i) {
+                local.m_slots[i - half] = local.m_slots[i];
+            }
+            local.m_count -= half;
+        }
+        local.m_slots[local.m_count++] = ptr;
+    }
+
+    void push_slots(void* const* slots, std::uint32_t count)
+    {
+        std::uint32_t first = index_of(slots[0]);
+        const std::uint32_t head = first;
+        for (std::uint32_t i = 1; i < count; ++i) {
+            const std::uint32_t next = index_of(slots[i]);
+            link(first).store(next + 1, std::memory_order_relaxed);
+            first = next;
+        }
+        push(head, first);
+    }
+
+    bool fits(std::size_t bytes) const
+    {
+        const std::size_t size = m_slot_size.load(std::memory_order_acquire);
+        // Until the first slab is created, anything may set the slot size.
+        return size == 0 || bytes <= size;
+    }
+
+    unsigned char* slot(std::uint32_t index) const
+    {
+        const slab& s = m_slabs[index / m_slab_slots];
+        return s.m_slots + index % m_slab_slots * m_slot_size.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint32_t>& link(std::uint32_t index) const
+    {
+        return m_slabs[index / m_slab_slots].m_links[index % m_slab_slots];
+    }
+
+    /** The slab ptr lies in, or none if it isn't from the pool. */
+    std::uint32_t slab_of(const void* ptr) const
+    {
+        const std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(ptr);
+        const std::size_t size = m_slot_size.load(std::memory_order_relaxed);
+        const std::uintptr_t c = addr >> m_cell_shift.load(std::memory_order_relaxed);
+        for (std::size_t i = cell_hash(c);; i = (i + 1) & m_cell_mask) {
+            const cell& entry = m_cells[i];
+            const std::uintptr_t stored = entry.m_cell.load(std::memory_order_acquire);
+            if (stored == 0) return none;
+            if (stored != c + 1) continue;
+            const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(m_slabs[entry.m_slab].m_slots);
+            if (addr >= begin && addr < begin + m_slab_slots * size) return entry.m_slab;
+        }
+    }
+    bool owns(const void* ptr) const
+    {
+        return slab_of(ptr) != none;
+    }
+    std::uint32_t index_of(const void* ptr) const
+    {
+        const std::uint32_t slab_index = slab_of(ptr);
+        const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(m_slabs[slab_index].m_slots);
+        const std::size_t offset = reinterpret_cast<std::uintptr_t>(ptr) - begin;
+        return static_cast<std::uint32_t>(slab_index * m_slab_slots + offset / m_slot_size.load(std::memory_order_relaxed));
+    }
+
+    std::uint32_t pop()
+    {
+        std::uint64_t head = m_head.load(std::memory_order_acquire);
+        while (head & index_mask) {
+            const std::uint32_t index = static_cast<std::uint32_t>((head & index_mask) - 1);
+            // May be stale if the slot was just taken, in which case the tag
+            // has moved on and the exchange fails.
+            const std::uint64_t next = ((head & ~index_mask) + tag_one) | link(index).load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+                return index;
+            }
+        }
+        return none;
+    }
+
+    /** Push the chain of slots first..last, already linked to each other. */
+    void push(std::uint32_t first, std::uint32_t last)
+    {
+        std::uint64_t head = m_head.load(std::memory_order_relaxed);
+        std::uint64_t next;
+        do {
+            link(last).store(static_cast<std::uint32_t>(head & index_mask), std::memory_order_relaxed);
+            next = ((head & ~index_mask) + tag_one) | (first + 1);
+        } while (!m_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /**
+     * Add a slab, keeping one of its slots for the caller and putting the
+     * rest on the freelist. Returns none when the pool is full, or when
+     * bytes doesn't fit the slots after all.
+     */
+    std::uint32_t grow(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_grow_mutex);
+        // Somebody else may have grown the pool while we waited.
+        const std::uint32_t index = pop();
+        if (index != none) return index;
+
+        std::size_t size = m_slot_size.load(std::memory_order_relaxed);
+        if (size == 0) {
+            size = (bytes + line - 1) / line * line;
+            unsigned shift = 0;
+            while ((std::size_t{1} << shift) < m_slab_slots * size) ++shift;
+            m_cell_shift.store(shift, std::memory_order_relaxed);
+            m_slot_size.store(size, std::memory_order_release);
+        }
+        const std::size_t count = m_slab_count.load(std::memory_order_relaxed);
+        if (bytes > size || count == m_max_slabs) return none;
+
+        const std::size_t slots_bytes = m_slab_slots * size;
+        slab& s = m_slabs[count];
+        s.m_raw = ::operator new(slots_bytes + m_slab_slots * sizeof(std::atomic<std::uint32_t>) + line - 1);
+        const std::uintptr_t raw = reinterpret_cast<std::uintptr_t>(s.m_raw);
+        s.m_slots = static_cast<unsigned char*>(s.m_raw) + ((line - raw % line) % line);
+        s.m_links = reinterpret_cast<std::atomic<std::uint32_t>*>(s.m_slots + slots_bytes);
+        for (std::size_t i = 0; i < m_slab_slots; ++i) {
+            ::new (&s.m_links[i]) std::atomic<std::uint32_t>(0);
+        }
+        const unsigned shift = m_cell_shift.load(std::memory_order_relaxed);
+        const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(s.m_slots);
+        add_cell(begin >> shift, static_cast<std::uint32_t>(count));
+        if ((begin + slots_bytes - 1) >> shift != begin >> shift) {
+            add_cell((begin + slots_bytes - 1) >> shift, static_cast<std::uint32_t>(count));
+        }
+        m_slab_count.store(count + 1, std::memory_order_release);
+
+        const std::uint32_t first = static_cast<std::uint32_t>(count * m_slab_slots);
+        const std::uint32_t last = static_cast<std::uint32_t>(first + m_slab_slots - 1);
+        if (first != last) {
+            for (std::uint32_t i = first + 1; i < last; ++i) {
+                link(i).store(i + 2, std::memory_order_relaxed);
+            }
+            push(first + 1, last);
+        }
+        return first;
+    }
+
+    const std::size_t m_slab_slots;
+    const std::size_t m_max_slabs;
+    std::unique_ptr<slab[]> m_slabs;
+    std::atomic<std::size_t> m_slab_count{0};
+    std::atomic<std::size_t> m_slot_size{0};
+    std::atomic<unsigned> m_cell_shift{0};
+    const std::size_t m_cell_mask;
+    std::unique_ptr<cell[]> m_cells;
+    const std::uint64_t m_id{next_id()};
+    std::atomic<std::uint64_t> m_head{0};
+    std::mutex m_grow_mutex;
+};
+
+/** An allocator taking its memory from a strong_slab_pool. */
+template <typename V>
+struct strong_pool_allocator
+{
+    using value_type = V;
+
+    explicit strong_pool_allocator(strong_slab_pool& pool) noexcept : m_pool{&pool} {}
+    template <typename U>
+    strong_pool_allocator(const strong_pool_allocator<U>& rhs) noexcept : m_pool{rhs.m_pool}
+    {
+    }
+
+    V* allocate(std::size_t n)
+    {
+        return static_cast<V*>(m_pool->allocate(n * sizeof(V), alignof(V)));
+    }
+    void deallocate(V* ptr, std::size_t n)
+    {
+        m_pool->deallocate(ptr, n * sizeof(V), alignof(V));
+    }
+
+    template <typename U>
+    bool operator==(const strong_pool_allocator<U>& rhs) const
+    {
+        return m_pool == rhs.m_pool;
+    }
+    template <typename U>
+    bool operator!=(const strong_pool_allocator<U>& rhs) const
+    {
+        return m_pool != rhs.m_pool;
+    }
+
+    strong_slab_pool* m_pool;
+};
+
+/**
+ * Hands out strong_ptr<T>s whose objects live in the pool's slots, along
+ * with all of their bookkeeping. Once an object has decayed and its last
+ * reference is gone, it is destroyed and its slot goes straight back to the
+ * pool, so that at steady state nothing touches the heap.
+ *
+ * Slabs of slab_slots slots are added as needed, up to max_slabs of them;
+ * beyond that, objects come from the heap. The pool must outlive every
+ * pointer and loan made from it.
+ */
+template <typename T>
+class strong_pool
+{
+public:
+    using allocator_type = strong_pool_allocator<T>;
+
+    explicit strong_pool(std::size_t slab_slots = 64, std::size_t max_slabs = 64) : m_slabs{slab_slots, max_slabs} {}
+
+    template <typename... Args>
+    strong_ptr<T> make(Args&&... args)
+    {
+        return allocate_strong<T>(get_allocator(), std::forward<Args>(args)...);
+    }
+
+    allocator_type get_allocator()
+    {
+        return allocator_type(m_slabs);
+    }
+
+    std::size_t capacity() const
+    {
+        return m_slabs.capacity();
+    }
+
+private:
+    strong_slab_pool m_slabs;
+};
+
+#endif // BITCOIN_STRONGPOOL_H
@@ -6,100 +6,2081 @@
 #define BITCOIN_STRONGPTR_H
 
 #include <memory>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Unless set to 0, decay_ptr::wait() blocks with std::atomic::wait when the
+// standard library provides it. The other waits, which take a timeout or a
+// predicate, always use a condition variable.
+#ifndef STRONG_PTR_ATOMIC_WAIT
+#if defined(__cpp_lib_atomic_wait)
+#define STRONG_PTR_ATOMIC_WAIT 1
+#else
+#define STRONG_PTR_ATOMIC_WAIT 0
+#endif
+#endif
+
+// Define STRONG_PTR_BLOCK_CACHE to 1 to recycle the fixed-size allocations
+// made with the default allocator (loan blocks and wake states) through
+// strong_block_cache rather than freeing them.
+#ifndef STRONG_PTR_BLOCK_CACHE
+#define STRONG_PTR_BLOCK_CACHE 0
+#endif
+
+// decay_ptr can be awaited from a C++20 coroutine when the compiler and the
+// standard library support them, see decay_ptr::decayed_async().
+#ifndef STRONG_PTR_COROUTINES
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define STRONG_PTR_COROUTINES 1
+#endif
+#endif
+#endif
+#ifndef STRONG_PTR_COROUTINES
+#define STRONG_PTR_COROUTINES 0
+#endif
+
+#if STRONG_PTR_COROUTINES
+#include <coroutine>
+#endif
+
+// Define STRONG_PTR_INSTRUMENT to 1 to report loans, decays and waits to a
+// strong_ptr_sink, or to 2 to also record where the loans of each object
+// taken with get_shared() came from, see strong_loan_registry. When left at
+// 0, none of it is compiled in.
+#ifndef STRONG_PTR_INSTRUMENT
+#define STRONG_PTR_INSTRUMENT 0
+#endif
+
+#if STRONG_PTR_INSTRUMENT >= 2
+#include <unordered_map>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#endif
+
+template <typename T>
+class loan_ref;
+
+template <typename T>
+class loan_batch;
+
+template <typename T>
+class local_loan;
 
 template <typename T>
+class weak_loan;
+
+/** The default threading policy: loans and waits may be used from any thread. */
+struct multi_thread
+{
+    template <typename T>
+    using loan = std::shared_ptr<T>;
+};
+
+/**
+ * A threading policy for pointers whose loans and decay_ptr never leave the
+ * owner's thread. Loans are counted with plain integers, and as nothing else
+ * could release them, waits only check whether the pointer has decayed.
+ */
+struct single_thread
+{
+    template <typename T>
+    using loan = local_loan<T>;
+};
+
+template <typename T, typename Policy = multi_thread>
+class strong_ptr;
+
+template <typename T, typename Policy = multi_thread>
 class decay_ptr;
 
-struct wake_type
-{
-    std::condition_variable m_cond{};
-    std::mutex m_mut{};
+struct strong_anchor;
+
+#if STRONG_PTR_BLOCK_CACHE
+/**
+ * Recycles small allocations in a few size classes. Each thread keeps its own
+ * freelists, so allocating and freeing never touch the heap (or any shared
+ * state) while a thread frees about as many blocks as it allocates. When a
+ * thread's list grows past local_limit, a batch moves to a global list that
+ * other threads refill from, which keeps blocks freed on one thread and
+ * allocated on another out of the heap too. A thread's lists are handed to
+ * the global list when it exits.
+ */
+class strong_block_cache
+{
+public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t classes = 4;
+    static constexpr std::size_t max_size = granularity * classes;
+    static constexpr std::size_t local_limit = 64;
+    static constexpr std::size_t batch = local_limit / 2;
+    static constexpr std::size_t global_limit = 64 * local_limit;
+
+    /** Whether allocations of this size and alignment are cached. */
+    static constexpr bool cacheable(std::size_t size, std::size_t align)
+    {
+        return size <= max_size && align <= alignof(std::max_align_t);
+    }
+
+    static void* allocate(std::size_t size)
+    {
+        const std::size_t cls = size_class(size);
+        local_lists& local = get_local();
+        if (!local.m_dead) {
+            global_lists& global = get_global();
+            if (!local.m_lists[cls].m_head && global.m_available[cls].load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> lock(global.m_mutex);
+                local.m_lists[cls].push(global.take(cls, batch));
+            }
+            if (node* n = local.m_lists[cls].pop(1)) {
+                return n;
+            }
+        }
+        return ::operator new((cls + 1) * granularity);
+    }
+
+    static void deallocate(void* ptr, std::size_t size)
+    {
+        const std::size_t cls = size_class(size);
+        local_lists& local = get_local();
+        if (local.m_dead) {
+            release(ptr);
+            return;
+        }
+        local.m_lists[cls].push(::new (ptr) node);
+        if (local.m_lists[cls].m_count > local_limit) {
+            node* overflow = local.m_lists[cls].pop(batch);
+            global_lists& global = get_global();
+            std::unique_lock<std::mutex> lock(global.m_mutex);
+            if (global.m_lists[cls].m_count < global_limit) {
+                global.give(cls, overflow);
+                overflow = nullptr;
+            }
+            lock.unlock();
+            release_all(overflow);
+        }
+    }
+
+private:
+    struct node {
+        node* m_next{nullptr};
+    };
+
+    struct list {
+        std::size_t m_count{0};
+        node* m_head{nullptr};
+
+        /** Unlink up to count nodes, returned as a chain. */
+        node* pop(std::size_t count)
+        {
+            node* first = m_head;
+            node* last = nullptr;
+            for (std::size_t i = 0; i < count && m_head; ++i, --m_count) {
+                last = m_head;
+                m_head = m_head->m_next;
+            }
+            if (last) last->m_next = nullptr;
+            return last ? first : nullptr;
+        }
+        void push(node* chain)
+        {
+            while (chain) {
+                node* next = chain->m_next;
+                chain->m_next = m_head;
+                m_head = chain;
+                ++m_count;
+                chain = next;
+            }
+        }
+    };
+
+    // Trivially destructible, so that it can still be used (falling back to
+    // the heap) by blocks freed during thread teardown.
+    struct local_lists {
+        list m_lists[classes];
+        bool m_dead;
+    };
+
+    struct local_flusher {
+        ~local_flusher()
+        {
+            local_lists& local = get_local();
+            global_lists& global = get_global();
+            std::lock_guard<std::mutex> lock(global.m_mutex);
+            for (std::size_t cls = 0; cls < classes; ++cls) {
+                global.give(cls, local.m_lists[cls].pop(local.m_lists[cls].m_count));
+            }
+            local.m_dead = true;
+        }
+    };
+
+    struct global_lists {
+        std::mutex m_mutex;
+        list m_lists[classes];
+        // Mirrors the list sizes, so that an empty list can be skipped
+        // without locking.
+        std::atomic<std::size_t> m_available[classes]{};
+
+        // Both require m_mutex.
+        node* take(std::size_t cls, std::size_t count)
+        {
+            node* chain = m_lists[cls].pop(count);
+            m_available[cls].store(m_lists[cls].m_count, std::memory_order_relaxed);
+            return chain;
+        }
+        void give(std::size_t cls, node* chain)
+        {
+            m_lists[cls].push(chain);
+            m_available[cls].store(m_lists[cls].m_count, std::memory_order_relaxed);
+        }
+    };
+
+    static std::size_t size_class(std::size_t size)
+    {
+        assert(size > 0 && size <= max_size);
+        return (size - 1) / granularity;
+    }
+
+    static local_lists& get_local()
+    {
+        static thread_local local_lists local{};
+        static thread_local local_flusher flusher;
+        (void)flusher;
+        return local;
+    }
+
+    static global_lists& get_global()
+    {
+        // Never destroyed, blocks may be freed during static destruction.
+        static global_lists* global = new global_lists;
+        return *global;
+    }
+
+    static void release(void* ptr)
+    {
+        ::operator delete(ptr);
+    }
+
+    static void release_all(node* chain)
+    {
+        while (chain) {
+            node* next = chain->m_next;
+            release(chain);
+            chain = next;
+        }
+    }
+};
+
+/** A std::allocator replacement taking small allocations from strong_block_cache. */
+template <typename V>
+struct strong_cache_allocator
+{
+    using value_type = V;
+
+    strong_cache_allocator() = default;
+    template <typename U>
+    strong_cache_allocator(const strong_cache_allocator<U>&) noexcept {}
+
+    V* allocate(std::size_t n)
+    {
+        if (!strong_block_cache::cacheable(n * sizeof(V), alignof(V))) return std::allocator<V>().allocate(n);
+        return static_cast<V*>(strong_block_cache::allocate(n * sizeof(V)));
+    }
+    void deallocate(V* ptr, std::size_t n)
+    {
+        if (!strong_block_cache::cacheable(n * sizeof(V), alignof(V))) return std::allocator<V>().deallocate(ptr, n);
+        strong_block_cache::deallocate(ptr, n * sizeof(V));
+    }
+
+    template <typename U>
+    bool operator==(const strong_cache_allocator<U>&) const
+    {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const strong_cache_allocator<U>&) const
+    {
+        return false;
+    }
+};
+
+template <typename V>
+using strong_default_allocator = strong_cache_allocator<V>;
+#else
+template <typename V>
+using strong_default_allocator = std::allocator<V>;
+#endif // STRONG_PTR_BLOCK_CACHE
+
+/** Hint to the cpu that we are busy-waiting. */
+inline void strong_cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Wait policy for decay_ptr::wait(): check decayed() up to m_spins times
+ * before blocking, pausing between checks. The pause starts at one cpu relax
+ * and doubles after each check, up to m_max_pause.
+ *
+ * Blocking costs a syscall on both the waiting and the releasing side, which
+ * is far more than a loan that is only held for a few microseconds.
+ */
+struct spin_then_block
+{
+    constexpr explicit spin_then_block(unsigned spins = 64, unsigned max_pause = 64) : m_spins{spins}, m_max_pause{max_pause} {}
+
+    /** Spin until pred() is true or the budget is used up. Returns pred(). */
+    template <typename Predicate>
+    bool spin(Predicate pred) const
+    {
+        unsigned pause = 1;
+        for (unsigned i = 0; i < m_spins; ++i) {
+            if (pred()) return true;
+            for (unsigned j = 0; j < pause; ++j) {
+                strong_cpu_relax();
+            }
+            if (pause < m_max_pause) pause *= 2;
+        }
+        return pred();
+    }
+
+    unsigned m_spins;
+    unsigned m_max_pause;
+};
+
+struct wake_type
+{
+    std::condition_variable m_cond{};
+    std::mutex m_mut{};
+    // Threads currently inside a wait. Lets the waker skip locking and
+    // notifying when nobody is blocked.
+    std::atomic<std::size_t> m_waiters{0};
+
+    /** Registers the current thread as a waiter for its lifetime. */
+    class waiting
+    {
+    public:
+        explicit waiting(wake_type& wake) : m_wake{wake}
+        {
+            m_wake.m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        }
+        ~waiting()
+        {
+            m_wake.m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+        waiting(const waiting&) = delete;
+        waiting& operator=(const waiting&) = delete;
+
+    private:
+        wake_type& m_wake;
+    };
+};
+
+/** A small number identifying the calling thread, used to pick shards. */
+inline unsigned strong_thread_index()
+{
+    static std::atomic<unsigned> next{0};
+    static thread_local const unsigned index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+struct strong_shard_anchor;
+
+/** Loans spread over several control blocks, see strong_ptr::enable_sharding(). */
+struct strong_shards
+{
+    const std::shared_ptr<strong_shard_anchor>& pick() const
+    {
+        return m_loans[strong_thread_index() % m_loans.size()];
+    }
+
+    std::vector<std::shared_ptr<strong_shard_anchor>> m_loans;
+};
+
+#if STRONG_PTR_INSTRUMENT
+/**
+ * Receives instrumentation events, see STRONG_PTR_INSTRUMENT; override the
+ * ones of interest. object is the address of the object concerned. Events
+ * come from whichever thread causes them, possibly concurrently, and the
+ * handlers must not throw.
+ *
+ * Loans are reported as they are taken, not as they are released: most are
+ * std::shared_ptrs, whose copies and releases can't be observed without a
+ * control block per loan. on_decayed() marks the end of an object's loans.
+ */
+class strong_ptr_sink
+{
+public:
+    virtual ~strong_ptr_sink() = default;
+    /**
+     * A loan of a strong_ptr's object was taken: with get_shared() or one of
+     * its variants, borrow(), or weak_loan::lock().
+     */
+    virtual void on_loan(const void* /* object */) {}
+    /** count loans were taken at once, with get_shared_n(). */
+    virtual void on_loans(const void* object, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; ++i) {
+            on_loan(object);
+        }
+    }
+    /** A strong_ptr was moved into a decay_ptr. */
+    virtual void on_decay_started(const void* /* object */) {}
+    /** The last loan was released, elapsed after the decay started. */
+    virtual void on_decayed(const void* /* object */, std::chrono::nanoseconds /* elapsed */) {}
+    /** A wait of a decay_ptr returned after waited. */
+    virtual void on_wait(const void* /* object */, std::chrono::nanoseconds /* waited */) {}
+};
+
+/** Where the events are sent. The sink must outlive its use. */
+struct strong_ptr_instrument
+{
+    static void set_sink(strong_ptr_sink* sink)
+    {
+        slot().store(sink, std::memory_order_release);
+    }
+    static strong_ptr_sink* sink()
+    {
+        return slot().load(std::memory_order_acquire);
+    }
+
+private:
+    static std::atomic<strong_ptr_sink*>& slot()
+    {
+        static std::atomic<strong_ptr_sink*> sink{nullptr};
+        return sink;
+    }
+};
+
+/** Reports the duration of a wait when it goes out of scope. */
+class strong_wait_timer
+{
+public:
+    explicit strong_wait_timer(const void* object) : m_object{object}, m_start{std::chrono::steady_clock::now()} {}
+    ~strong_wait_timer()
+    {
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) {
+            sink->on_wait(m_object, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start));
+        }
+    }
+
+private:
+    const void* m_object;
+    std::chrono::steady_clock::time_point m_start;
+};
+#endif
+
+#if STRONG_PTR_INSTRUMENT >= 2
+/** Where a loan was taken. */
+struct strong_loan_site
+{
+    /** Like std::source_location::current(), which needs C++20. */
+    static strong_loan_site current(const char* file = __builtin_FILE(), int line = __builtin_LINE())
+    {
+        return strong_loan_site{file, line};
+    }
+
+    const char* m_file;
+    int m_line;
+};
+
+struct strong_loan_record
+{
+    const void* m_object;
+    strong_loan_site m_site;
+    // How many loans were taken there, and when the last one was.
+    std::size_t m_loans;
+    std::chrono::steady_clock::time_point m_taken;
+};
+
+/**
+ * Where the loans of each object were taken with get_shared(), e.g. to find
+ * out who is holding up a decay. Loans are recorded per object and site,
+ * and an object's records are dropped once all of its loans are gone: when
+ * it decays, or its owner lets go of it unloaned. Individual loans aren't
+ * followed to their release, as that would take a control block of their
+ * own and change what use_count() reports, so a record may also count
+ * loans from its site which have already been released.
+ */
+class strong_loan_registry
+{
+public:
+    /** The records of object, or of every object if it is null. */
+    static std::vector<strong_loan_record> outstanding(const void* object = nullptr)
+    {
+        std::vector<strong_loan_record> records;
+        state& s = get();
+        std::lock_guard<std::mutex> lock(s.m_mut);
+        for (const auto& entry : s.m_objects) {
+            if (object && entry.first != object) continue;
+            records.insert(records.end(), entry.second.begin(), entry.second.end());
+        }
+        return records;
+    }
+
+    static void record(const void* object, strong_loan_site site)
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        state& s = get();
+        std::lock_guard<std::mutex> lock(s.m_mut);
+        std::vector<strong_loan_record>& records = s.m_objects[object];
+        for (strong_loan_record& record : records) {
+            if (record.m_site.m_line == site.m_line && record.m_site.m_file == site.m_file) {
+                ++record.m_loans;
+                record.m_taken = now;
+                return;
+            }
+        }
+        records.push_back(strong_loan_record{object, site, 1, now});
+    }
+
+    /** All of object's loans are gone. */
+    static void forget(const void* object)
+    {
+        state& s = get();
+        std::lock_guard<std::mutex> lock(s.m_mut);
+        s.m_objects.erase(object);
+    }
+
+private:
+    struct state {
+        std::mutex m_mut;
+        std::unordered_map<const void*, std::vector<strong_loan_record>> m_objects;
+    };
+    static state& get()
+    {
+        static state s;
+        return s;
+    }
+};
+#endif
+
+/**
+ * A type-erased, move-only void() callable: a callback to run on decay, as
+ * stored with the decay state and handed to executors.
+ */
+class strong_decay_task
+{
+    struct callable {
+        virtual ~callable() = default;
+        virtual void run() = 0;
+    };
+    template <typename F>
+    struct callable_impl : callable {
+        explicit callable_impl(F&& fn) : m_fn(std::move(fn)) {}
+        void run() override
+        {
+            m_fn();
+        }
+        F m_fn;
+    };
+
+public:
+    strong_decay_task() = default;
+
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, strong_decay_task>::value>::type>
+    explicit strong_decay_task(F fn) : m_callable(new callable_impl<F>(std::move(fn)))
+    {
+    }
+
+    void operator()()
+    {
+        m_callable->run();
+    }
+    explicit operator bool() const
+    {
+        return m_callable != nullptr;
+    }
+
+private:
+    std::unique_ptr<callable> m_callable;
+};
+
+/** Runs decay callbacks right away, on the thread that decayed the object. */
+struct strong_inline_executor
+{
+    void operator()(strong_decay_task task) const
+    {
+        task();
+    }
+};
+
+/**
+ * The decay state of an object, and what is needed to wait for it.
+ *
+ * m_state holds the decay flag along with flags describing who may be
+ * waiting for it, so that whoever decays it can tell with a single atomic
+ * operation whether anybody needs waking. Most objects are never waited for,
+ * so the condition variable based wake state is only created by the first
+ * waiter that needs it.
+ *
+ * A callback to run on decay is handed over the same way: whichever of its
+ * registration and the decay comes second in m_state runs it.
+ */
+struct strong_decay_state
+{
+    static constexpr std::uint32_t decayed_flag = 1;
+    // A thread is (or was) blocked in std::atomic::wait on m_state.
+    static constexpr std::uint32_t waiting_flag = 2;
+    // m_wake has been published.
+    static constexpr std::uint32_t wake_flag = 4;
+    // m_on_decay has been published.
+    static constexpr std::uint32_t callback_flag = 8;
+
+    strong_decay_state() = default;
+    strong_decay_state(const strong_decay_state&) = delete;
+    strong_decay_state& operator=(const strong_decay_state&) = delete;
+
+    // Blocks override these to take the wake state from their allocator.
+#if STRONG_PTR_BLOCK_CACHE
+    virtual wake_type* new_wake()
+    {
+        void* mem = strong_block_cache::allocate(sizeof(wake_type));
+        try {
+            return ::new (mem) wake_type;
+        } catch (...) {
+            strong_block_cache::deallocate(mem, sizeof(wake_type));
+            throw;
+        }
+    }
+    virtual void delete_wake(wake_type* wake)
+    {
+        wake->~wake_type();
+        strong_block_cache::deallocate(wake, sizeof(wake_type));
+    }
+#else
+    virtual wake_type* new_wake()
+    {
+        return new wake_type;
+    }
+    virtual void delete_wake(wake_type* wake)
+    {
+        delete wake;
+    }
+#endif
+
+    /** Called right before the block is destroyed. */
+    void release_wake()
+    {
+        if (wake_type* wake = m_wake.load(std::memory_order_relaxed)) {
+            delete_wake(wake);
+        }
+    }
+
+    bool decayed() const
+    {
+        // seq_cst so that a registered waiter checking this cannot miss the
+        // waker, see notify_decayed().
+        return m_state.load(std::memory_order_seq_cst) & decayed_flag;
+    }
+
+    /**
+     * Mark the block as decayed and wake up anyone waiting for that. When no
+     * thread is waiting this is a single atomic operation (plus a load if a
+     * wake state was ever created).
+     */
+    void notify_decayed()
+    {
+        // Pairs with the registration in wake_type::waiting: either the waiter
+        // sees the flag, or this sees the waiter.
+        const std::uint32_t state = m_state.fetch_or(decayed_flag, std::memory_order_seq_cst);
+#if STRONG_PTR_ATOMIC_WAIT
+        if (state & waiting_flag) {
+            m_state.notify_all();
+        }
+#endif
+        if (state & wake_flag) {
+            wake_type* wake = m_wake.load(std::memory_order_acquire);
+            if (wake->m_waiters.load(std::memory_order_seq_cst) != 0) {
+                {
+                    // Necessary dummy lock
+                    std::lock_guard<std::mutex> lock(wake->m_mut);
+                }
+                wake->m_cond.notify_all();
+            }
+        }
+        if (state & callback_flag) {
+            run_on_decay();
+        }
+    }
+
+    /**
+     * Have callback run once decayed: by whoever decays the object, or right
+     * away if it already has. There can only be one per decay.
+     */
+    void set_on_decay(strong_decay_task&& callback)
+    {
+        if (!try_set_on_decay(std::move(callback))) {
+            run_on_decay();
+        }
+    }
+    /**
+     * Like set_on_decay, but if the object has already decayed, returns
+     * false with the callback still stored instead of running it.
+     */
+    bool try_set_on_decay(strong_decay_task&& callback)
+    {
+        assert(!m_on_decay);
+        m_on_decay = std::move(callback);
+        const std::uint32_t state = m_state.fetch_or(callback_flag, std::memory_order_acq_rel);
+        return !(state & decayed_flag);
+    }
+    /**
+     * Take back a callback stored with try_set_on_decay, so that another can
+     * be set for this decay. Fails, leaving the callback to run, if the
+     * object has decayed in the meantime.
+     */
+    bool try_take_on_decay()
+    {
+        std::uint32_t state = m_state.load(std::memory_order_acquire);
+        while (!(state & decayed_flag)) {
+            assert(state & callback_flag);
+            if (m_state.compare_exchange_weak(state, state & ~callback_flag, std::memory_order_acq_rel)) {
+                m_on_decay = strong_decay_task();
+                return true;
+            }
+        }
+        return false;
+    }
+    void run_on_decay()
+    {
+        strong_decay_task callback = std::move(m_on_decay);
+        callback();
+    }
+
+    /** Block until decayed, waiting on m_state directly if possible. */
+    void wait_decayed()
+    {
+#if STRONG_PTR_ATOMIC_WAIT
+        std::uint32_t state = m_state.load(std::memory_order_acquire);
+        while (!(state & decayed_flag)) {
+            if (!(state & waiting_flag)) {
+                if (!m_state.compare_exchange_weak(state, state | waiting_flag, std::memory_order_seq_cst)) continue;
+                state |= waiting_flag;
+            }
+            m_state.wait(state, std::memory_order_acquire);
+            state = m_state.load(std::memory_order_acquire);
+        }
+#else
+        wait([this] { return decayed(); });
+#endif
+    }
+
+    /**
+     * Get the wake state, creating it if necessary. Returns nullptr once the
+     * block has decayed, as there will be no more wakeups.
+     */
+    wake_type* get_wake()
+    {
+        std::uint32_t state = m_state.load(std::memory_order_acquire);
+        if (state & decayed_flag) return nullptr;
+        if (!(state & wake_flag)) {
+            wake_type* wake = new_wake();
+            wake_type* expected = nullptr;
+            if (!m_wake.compare_exchange_strong(expected, wake, std::memory_order_acq_rel)) {
+                delete_wake(wake);
+            }
+            // If decay won the race, the waker never saw the wake state.
+            state = m_state.fetch_or(wake_flag, std::memory_order_acq_rel);
+            if (state & decayed_flag) return nullptr;
+        }
+        return m_wake.load(std::memory_order_acquire);
+    }
+
+    // Wait on the wake state until stop_waiting returns true, or the state
+    // has decayed: the decay is the last wakeup there will be, so waiting
+    // stops there either way. The timed waits return the last result of
+    // stop_waiting, like std::condition_variable's.
+
+    template <class Predicate>
+    void wait(Predicate stop_waiting)
+    {
+        wake_type* wake = get_wake();
+        if (!wake) return;
+        wake_type::waiting waiting(*wake);
+        std::unique_lock<std::mutex> lock(wake->m_mut);
+        wake->m_cond.wait(lock, [&] { return stop_waiting() || decayed(); });
+    }
+
+    template <class Rep, class Period, class Predicate>
+    bool wait_for(const std::chrono::duration<Rep, Period>& rel_time, Predicate stop_waiting)
+    {
+        wake_type* wake = get_wake();
+        if (!wake) return stop_waiting();
+        wake_type::waiting waiting(*wake);
+        std::unique_lock<std::mutex> lock(wake->m_mut);
+        bool stop = false;
+        wake->m_cond.wait_for(lock, rel_time, [&] { return (stop = stop_waiting()) || decayed(); });
+        return stop;
+    }
+
+    template <class Clock, class Duration, class Predicate>
+    bool wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time, Predicate stop_waiting)
+    {
+        wake_type* wake = get_wake();
+        if (!wake) return stop_waiting();
+        wake_type::waiting waiting(*wake);
+        std::unique_lock<std::mutex> lock(wake->m_mut);
+        bool stop = false;
+        wake->m_cond.wait_until(lock, timeout_time, [&] { return (stop = stop_waiting()) || decayed(); });
+        return stop;
+    }
+
+    std::atomic<std::uint32_t> m_state{0};
+    std::atomic<wake_type*> m_wake{nullptr};
+    strong_decay_task m_on_decay;
+};
+
+/**
+ * What weak loans of an object refer to, see strong_ptr::get_weak(). It is
+ * created for the first weak loan, and forgets the object (under m_mut, so
+ * that no weak loan is upgraded meanwhile) as soon as its owner lets go.
+ * It lives in an allocation of its own, so weak loans never keep the object
+ * or its memory around.
+ */
+struct strong_weak_tether
+{
+    explicit strong_weak_tether(const std::shared_ptr<strong_anchor>& anchor) : m_anchor{anchor} {}
+
+    void add_ref()
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release_ref()
+    {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+    std::shared_ptr<strong_anchor> lock()
+    {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_anchor.lock();
+    }
+    bool expired()
+    {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_anchor.expired();
+    }
+    void cut()
+    {
+        std::weak_ptr<strong_anchor> anchor;
+        std::lock_guard<std::mutex> lock(m_mut);
+        anchor.swap(m_anchor);
+    }
+
+    std::atomic<std::size_t> m_refs{1};
+    std::mutex m_mut;
+    std::weak_ptr<strong_anchor> m_anchor;
+};
+
+/**
+ * Bookkeeping shared by a strong_ptr, its loans and the decay_ptr it turns
+ * into. A block always lives in the same allocation as the control block that
+ * counts the loans, directly behind it, and it is destroyed when that
+ * allocation is released. That happens once the last loan is gone and
+ * nothing owns the object anymore. The last loan decays it, see
+ * strong_anchor.
+ *
+ * The object is destroyed earlier, and separately: by whichever of the
+ * anchor and the observer (see m_holds) lets go of it last. Releasing the
+ * allocation can lag behind that on another thread, e.g. the one that
+ * released the last loan, and must not take the object with it, or a
+ * decay_ptr handed to an executor on decay would not decide where the
+ * object is destroyed.
+ *
+ * The block also holds everything the owning strong_ptr or decay_ptr needs,
+ * so that those are a single pointer to it: the object pointer, and the
+ * owner's loan (the owner's observer, once decaying). The latter two refer to
+ * the allocation containing the block, which keeps it alive for the owner.
+ * If sharding is enabled, the owner also holds a loan of each shard.
+ *
+ * Borrows and local loans (see loan_ref and local_loan) are counted without
+ * atomics, as they never leave the owner's thread, and batches of loans (see
+ * loan_batch) are counted together in m_batch. If the owner lets go while
+ * any of them are still out, its loan is parked in m_pin until the last one
+ * ends. Once a batch has been taken, m_batch also holds batch_owner on
+ * behalf of the owner, so that the batches alone can never drop the count
+ * to zero.
+ */
+struct strong_block : strong_decay_state
+{
+    static constexpr std::size_t batch_owner = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+
+    strong_block() = default;
+
+    template <typename T>
+    T* data() const
+    {
+        return static_cast<T*>(m_data);
+    }
+    template <typename T>
+    void set_data(T* data)
+    {
+        m_data = const_cast<void*>(static_cast<const volatile void*>(data));
+    }
+
+    // Releasing the owner's reference may free the block, so these must be
+    // the last use of it by the owner.
+
+    void release_owner()
+    {
+        // Once rearmed, the owner holds on to the observer, see rearm().
+        // That keeps the block alive for the rest of this.
+        const bool rearmed = m_rearmed;
+        std::weak_ptr<strong_anchor> observer;
+        if (rearmed) observer = std::move(m_observer);
+        drop_owner();
+        if (rearmed) release_object();
+    }
+    void start_decay()
+    {
+#if STRONG_PTR_INSTRUMENT
+        m_decay_started = std::chrono::steady_clock::now();
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) sink->on_decay_started(m_data);
+#endif
+        if (!m_rearmed) {
+            hold_object();
+            m_observer = m_owner;
+        }
+        drop_owner();
+    }
+    void drop_owner()
+    {
+        if (strong_weak_tether* tether = m_tether.exchange(nullptr, std::memory_order_acquire)) {
+            tether->cut();
+            tether->release_ref();
+        }
+        std::unique_ptr<strong_shards> shards = std::move(m_shards);
+        if (m_borrows) {
+            m_pin = std::move(m_owner);
+        } else {
+            release_owner_loan(std::move(m_owner));
+        }
+    }
+    void release_observer()
+    {
+        std::weak_ptr<strong_anchor> observer = std::move(m_observer);
+        release_object();
+    }
+
+    void hold_object()
+    {
+        m_holds.fetch_add(1, std::memory_order_relaxed);
+    }
+    /** Let go of the object, destroying it if nothing else holds it. */
+    void release_object()
+    {
+        if (m_holds.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy_object();
+    }
+    /** Destroy the object, but not the block. */
+    virtual void destroy_object() = 0;
+    void end_borrow()
+    {
+        if (--m_borrows == 0 && m_pin) release_owner_loan(std::move(m_pin));
+    }
+    void release_owner_loan(std::shared_ptr<strong_anchor>&& owner)
+    {
+        std::shared_ptr<strong_anchor> loan = std::move(owner);
+        if (m_batch.load(std::memory_order_relaxed) & batch_owner) {
+            m_pin = std::move(loan);
+            if (m_batch.fetch_sub(batch_owner, std::memory_order_acq_rel) != batch_owner) return;
+            loan = std::move(m_pin);
+        }
+    }
+
+    void take_batch(std::size_t count)
+    {
+        // The owner's share has to be in before any loans that may release it.
+        if (!(m_batch.load(std::memory_order_relaxed) & batch_owner)) {
+            m_batch.fetch_or(batch_owner, std::memory_order_relaxed);
+        }
+        m_batch.fetch_add(count, std::memory_order_relaxed);
+    }
+    void release_batch(std::size_t count)
+    {
+        if (m_batch.fetch_sub(count, std::memory_order_acq_rel) == count) {
+            std::shared_ptr<strong_anchor> pin = std::move(m_pin);
+        }
+    }
+
+    /**
+     * Give a decayed block a new owner, see decay_ptr::rearm(). The control
+     * block of the old loans cannot be revived, so this creates a new one,
+     * while the observer of the old one stays to keep the allocation holding
+     * the block alive. From here on the observer belongs to the block: the
+     * owner keeps it rather than taking a new one when decaying again, and
+     * releases it along with its loan. The wake state is reused as is, and
+     * so is the memory of the previous rearm's control block, once it has
+     * been released, see strong_rearm_allocator.
+     */
+    void rearm()
+    {
+        assert(decayed() && !m_owner);
+        hold_object();
+        m_owner = new_rearmed_anchor();
+        m_rearmed = true;
+        m_state.fetch_and(~(decayed_flag | waiting_flag | callback_flag), std::memory_order_acq_rel);
+    }
+    std::shared_ptr<strong_anchor> new_rearmed_anchor();
+
+    // Blocks override these to take the memory for the control blocks of
+    // rearmed loans from their allocator.
+    virtual void* allocate_anchor(std::size_t units)
+    {
+        return strong_default_allocator<std::max_align_t>().allocate(units);
+    }
+    virtual void deallocate_anchor(void* mem, std::size_t units)
+    {
+        strong_default_allocator<std::max_align_t>().deallocate(static_cast<std::max_align_t*>(mem), units);
+    }
+
+    /**
+     * Drop a reference to the allocation holding the block, releasing it
+     * with the last one. Its control block holds one, and so does every
+     * control block of rearmed loans, see strong_rearm_allocator.
+     */
+    void release_memory()
+    {
+        if (m_memory_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) m_release_memory(this);
+    }
+
+    /** Called right before the block is destroyed. */
+    void release_spare_anchor()
+    {
+        if (void* spare = m_spare_anchor.load(std::memory_order_acquire)) {
+            deallocate_anchor(spare, m_anchor_units);
+        }
+    }
+
+    /**
+     * If the object was handed over as a P released with a deleter of type
+     * D, tagged as by strong_type_tag<P, D>(), move the deleter to (raw)
+     * storage at deleter, and forget the object. See decay_ptr::release_unique().
+     */
+    virtual bool release_pointer(const void* /* tag */, void* /* deleter */)
+    {
+        return false;
+    }
+
+    /** The tether of weak loans, created by the first of them. Adds a reference for the caller. */
+    strong_weak_tether* weak_tether()
+    {
+        strong_weak_tether* tether = m_tether.load(std::memory_order_acquire);
+        if (!tether) {
+            strong_weak_tether* created = new strong_weak_tether(m_owner);
+            if (m_tether.compare_exchange_strong(tether, created, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                tether = created;
+            } else {
+                delete created;
+            }
+        }
+        tether->add_ref();
+        return tether;
+    }
+
+    /** The loan held by whoever currently keeps the object alive for the owner. */
+    const std::shared_ptr<strong_anchor>& owner_loan() const
+    {
+        return m_owner ? m_owner : m_pin;
+    }
+
+    void* m_data{nullptr};
+    std::shared_ptr<strong_anchor> m_owner;
+    std::weak_ptr<strong_anchor> m_observer;
+    std::unique_ptr<strong_shards> m_shards;
+    std::size_t m_borrows{0};
+    std::atomic<std::size_t> m_batch{0};
+    std::shared_ptr<strong_anchor> m_pin;
+    std::atomic<strong_weak_tether*> m_tether{nullptr};
+    // The current anchor, plus one while there is an observer.
+    std::atomic<std::size_t> m_holds{1};
+    // The memory of a released control block of rearmed loans, and its size.
+    std::atomic<void*> m_spare_anchor{nullptr};
+    std::size_t m_anchor_units{0};
+    std::atomic<std::size_t> m_memory_refs{1};
+    // Set by strong_block_allocator, along with the allocation's size.
+    void (*m_release_memory)(strong_block*){nullptr};
+    std::size_t m_memory_count{0};
+    bool m_rearmed{false};
+#if STRONG_PTR_INSTRUMENT
+    // When start_decay() was called, if it was.
+    std::chrono::steady_clock::time_point m_decay_started{};
+
+    void report_decayed()
+    {
+        const std::chrono::steady_clock::time_point started = std::exchange(m_decay_started, {});
+        if (started == std::chrono::steady_clock::time_point()) return;
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) {
+            sink->on_decayed(m_data, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started));
+        }
+    }
+#endif
+};
+
+/**
+ * The object managed by the loan control block. It is destroyed when the last
+ * loan (counting the one held by the owning strong_ptr) goes away, which is
+ * the moment of decay. The block behind it is still alive at that point.
+ *
+ * It lets go of the object before notifying the block, so that if anybody
+ * is waiting for the decay, they hold the object's last reference, and
+ * destroy it wherever they let go of it. Otherwise it destroys the object
+ * itself, once the decay callback (if any) has run.
+ */
+struct strong_anchor
+{
+    explicit strong_anchor(strong_block* const* block) : m_block{*block} {}
+    ~strong_anchor()
+    {
+#if STRONG_PTR_INSTRUMENT
+        m_block->report_decayed();
+#endif
+#if STRONG_PTR_INSTRUMENT >= 2
+        strong_loan_registry::forget(m_block->m_data);
+#endif
+        const bool last = m_block->m_holds.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        m_block->notify_decayed();
+        if (last) m_block->destroy_object();
+    }
+    strong_block* m_block;
+};
+
+/**
+ * Allocator handed to std::allocate_shared for the control blocks of rearmed
+ * loans. The block still lives in the allocation of its first control block,
+ * and each of these control blocks holds a reference to that allocation,
+ * from allocating its memory until it has deallocated it. The memory goes
+ * back to the block, for the next rearm() to reuse. A rearm that comes
+ * before the previous control block has been released, on another thread,
+ * allocates one of its own, and whichever of the two is released last is
+ * kept.
+ */
+template <typename V>
+struct strong_rearm_allocator
+{
+    using value_type = V;
+
+    static_assert(alignof(V) <= alignof(std::max_align_t), "control blocks are allocated as std::max_align_t");
+
+    explicit strong_rearm_allocator(strong_block* block) noexcept : m_block{block} {}
+    template <typename U>
+    strong_rearm_allocator(const strong_rearm_allocator<U>& rhs) noexcept : m_block{rhs.m_block}
+    {
+    }
+
+    V* allocate(std::size_t n)
+    {
+        const std::size_t count = units(n);
+        // A block only ever allocates one type (and size) of control block.
+        assert(m_block->m_anchor_units == 0 || m_block->m_anchor_units == count);
+        m_block->m_anchor_units = count;
+        void* mem = m_block->m_spare_anchor.exchange(nullptr, std::memory_order_acquire);
+        if (!mem) mem = m_block->allocate_anchor(count);
+        m_block->m_memory_refs.fetch_add(1, std::memory_order_relaxed);
+        return static_cast<V*>(mem);
+    }
+    void deallocate(V* ptr, std::size_t n)
+    {
+        strong_block* const block = m_block;
+        if (void* old = block->m_spare_anchor.exchange(ptr, std::memory_order_acq_rel)) {
+            block->deallocate_anchor(old, units(n));
+        }
+        block->release_memory();
+    }
+
+    template <typename U>
+    bool operator==(const strong_rearm_allocator<U>& rhs) const
+    {
+        return m_block == rhs.m_block;
+    }
+    template <typename U>
+    bool operator!=(const strong_rearm_allocator<U>& rhs) const
+    {
+        return m_block != rhs.m_block;
+    }
+
+    strong_block* m_block;
+
+private:
+    static std::size_t units(std::size_t n)
+    {
+        return (n * sizeof(V) + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+    }
+};
+
+inline std::shared_ptr<strong_anchor> strong_block::new_rearmed_anchor()
+{
+    strong_block* self = this;
+    return std::allocate_shared<strong_anchor>(strong_rearm_allocator<strong_anchor>(this), &self);
+}
+
+/** A block holding the object itself, as created by make_strong(). */
+template <typename T>
+struct strong_inplace_block : strong_block
+{
+    template <typename Alloc, typename... Args>
+    explicit strong_inplace_block(Alloc& alloc, Args&&... args)
+    {
+        using traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
+        typename traits::allocator_type a(alloc);
+        traits::construct(a, get(), std::forward<Args>(args)...);
+    }
+    template <typename Alloc>
+    void destroy(Alloc& alloc)
+    {
+        using traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
+        typename traits::allocator_type a(alloc);
+        traits::destroy(a, get());
+    }
+    T* get()
+    {
+        return reinterpret_cast<T*>(&m_storage);
+    }
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type m_storage;
+};
+
+/** A unique address for each pointer and deleter type, without RTTI. */
+template <typename P, typename D>
+const void* strong_type_tag()
+{
+    static const char tag = 0;
+    return &tag;
+}
+
+/** A block holding a pointer which is released with a deleter. */
+template <typename P, typename D>
+struct strong_pointer_block : strong_block
+{
+    template <typename Alloc, typename Deleter>
+    strong_pointer_block(Alloc& /* unused */, P ptr, Deleter&& deleter) : m_ptr{ptr}, m_deleter(std::forward<Deleter>(deleter))
+    {
+    }
+    template <typename Alloc>
+    void destroy(Alloc& /* unused */)
+    {
+        if (!m_released) m_deleter(m_ptr);
+    }
+    bool release_pointer(const void* tag, void* deleter) override
+    {
+        if (tag != strong_type_tag<P, D>()) return false;
+        ::new (deleter) D(std::move(m_deleter));
+        m_released = true;
+        return true;
+    }
+    P m_ptr;
+    D m_deleter;
+    bool m_released{false};
+};
+
+/**
+ * A block owning an array of size value-initialized Ts from its allocator,
+ * as created by make_strong_array().
+ */
+template <typename T>
+struct strong_array_block : strong_block
+{
+    template <typename Alloc>
+    strong_array_block(Alloc& alloc, std::size_t size) : m_size{size}
+    {
+        using traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
+        typename traits::allocator_type a(alloc);
+        m_ptr = traits::allocate(a, size);
+        std::size_t built = 0;
+        try {
+            for (; built < size; ++built) {
+                traits::construct(a, m_ptr + built);
+            }
+        } catch (...) {
+            while (built) traits::destroy(a, m_ptr + --built);
+            traits::deallocate(a, m_ptr, size);
+            throw;
+        }
+    }
+    template <typename Alloc>
+    void destroy(Alloc& alloc)
+    {
+        using traits = typename std::allocator_traits<Alloc>::template rebind_traits<T>;
+        typename traits::allocator_type a(alloc);
+        for (std::size_t i = m_size; i > 0; --i) {
+            traits::destroy(a, m_ptr + i - 1);
+        }
+        traits::deallocate(a, m_ptr, m_size);
+    }
+    T* m_ptr;
+    std::size_t m_size;
+};
+
+/** A block allocated with the default allocator. */
+template <typename Block, typename Alloc>
+struct strong_default_block : Block
+{
+    template <typename... Args>
+    explicit strong_default_block(Alloc& alloc, Args&&... args) : Block(alloc, std::forward<Args>(args)...)
+    {
+    }
+    void destroy_object() override
+    {
+        Alloc alloc;
+        this->destroy(alloc);
+    }
+    Alloc get_allocator() const
+    {
+        return Alloc();
+    }
+};
+
+/**
+ * Adds a copy of a (non-default) allocator to a block, for its wake state,
+ * the control blocks of rearmed loans and destroying the object.
+ */
+template <typename Block, typename Alloc>
+struct strong_allocated_block : Block
+{
+    template <typename... Args>
+    explicit strong_allocated_block(Alloc& alloc, Args&&... args) : Block(alloc, std::forward<Args>(args)...), m_alloc(alloc)
+    {
+    }
+    void destroy_object() override
+    {
+        Alloc alloc(m_alloc);
+        this->destroy(alloc);
+    }
+    Alloc get_allocator() const
+    {
+        return Alloc(m_alloc);
+    }
+    wake_type* new_wake() override
+    {
+        wake_type* wake = wake_traits::allocate(m_alloc, 1);
+        try {
+            wake_traits::construct(m_alloc, wake);
+        } catch (...) {
+            wake_traits::deallocate(m_alloc, wake, 1);
+            throw;
+        }
+        return wake;
+    }
+    void delete_wake(wake_type* wake) override
+    {
+        wake_traits::destroy(m_alloc, wake);
+        wake_traits::deallocate(m_alloc, wake, 1);
+    }
+    void* allocate_anchor(std::size_t units) override
+    {
+        typename unit_traits::allocator_type alloc(m_alloc);
+        return unit_traits::allocate(alloc, units);
+    }
+    void deallocate_anchor(void* mem, std::size_t units) override
+    {
+        typename unit_traits::allocator_type alloc(m_alloc);
+        unit_traits::deallocate(alloc, static_cast<std::max_align_t*>(mem), units);
+    }
+
+    using unit_traits = typename std::allocator_traits<Alloc>::template rebind_traits<std::max_align_t>;
+    using wake_traits = typename std::allocator_traits<Alloc>::template rebind_traits<wake_type>;
+    typename wake_traits::allocator_type m_alloc;
+};
+
+template <typename Alloc>
+struct strong_is_default_allocator : std::false_type {
+};
+template <typename T>
+struct strong_is_default_allocator<std::allocator<T>> : std::true_type {
+};
+
+/** The block type to construct for Block, when allocating with Alloc. */
+template <typename Block, typename Alloc>
+using strong_block_t = typename std::conditional<strong_is_default_allocator<Alloc>::value, strong_default_block<Block, Alloc>, strong_allocated_block<Block, Alloc>>::type;
+
+template <typename D>
+using strong_deleter_t = typename std::conditional<std::is_reference<D>::value, std::reference_wrapper<typename std::remove_reference<D>::type>, D>::type;
+
+
+/**
+ * A shard of the loans of a block. Its control block counts the loans handed
+ * out through it, and it holds a single loan of the block on their behalf, so
+ * the block decays once every shard has. The padding makes every shard's
+ * allocation at least a cache line long, so that the counts of two shards
+ * can never share a line.
+ */
+struct strong_shard_anchor
+{
+    explicit strong_shard_anchor(const std::shared_ptr<strong_anchor>& main) : m_main{main} {}
+    std::shared_ptr<strong_anchor> m_main;
+    unsigned char m_padding[64];
+};
+
+/**
+ * Allocator handed to std::allocate_shared for the loan control block. Each
+ * allocation is extended to fit a Block directly behind the control block.
+ * The Block is built by m_build as soon as the memory is available, and is
+ * destroyed right before the memory is released. By then, its object has
+ * been destroyed already, see strong_block. The memory is released once the
+ * control block, and the control blocks of any rearmed loans, are done
+ * with it, see strong_block::release_memory().
+ */
+template <typename V, typename Block, typename Alloc, typename Build>
+struct strong_block_allocator
+{
+    using value_type = V;
+
+    template <typename U>
+    struct rebind {
+        using other = strong_block_allocator<U, Block, Alloc, Build>;
+    };
+
+    strong_block_allocator(const Alloc& alloc, Build* build, strong_block** block) : m_alloc{alloc}, m_build{build}, m_block{block} {}
+
+    template <typename U>
+    strong_block_allocator(const strong_block_allocator<U, Block, Alloc, Build>& rhs) : m_alloc{rhs.m_alloc}, m_build{rhs.m_build}, m_block{rhs.m_block}
+    {
+    }
+
+    V* allocate(std::size_t n)
+    {
+        unit* mem = allocate_units(units(n), use_cache());
+        try {
+            *m_block = (*m_build)(block_at(mem, n), m_alloc);
+        } catch (...) {
+            deallocate_units(mem, units(n), use_cache());
+            throw;
+        }
+        (*m_block)->m_release_memory = &release;
+        (*m_block)->m_memory_count = n;
+        return reinterpret_cast<V*>(mem);
+    }
+
+    void deallocate(V* ptr, std::size_t n)
+    {
+        static_cast<Block*>(block_at(ptr, n))->release_memory();
+    }
+
+    template <typename U>
+    bool operator==(const strong_block_allocator<U, Block, Alloc, Build>& rhs) const
+    {
+        return m_alloc == rhs.m_alloc;
+    }
+    template <typename U>
+    bool operator!=(const strong_block_allocator<U, Block, Alloc, Build>& rhs) const
+    {
+        return !(*this == rhs);
+    }
+
+    Alloc m_alloc;
+    Build* m_build;
+    strong_block** m_block;
+
+private:
+    static constexpr std::size_t align = alignof(V) > alignof(Block) ? alignof(V) : alignof(Block);
+    struct alignas(align) unit {
+        unsigned char m_bytes[align];
+    };
+    using unit_traits = typename std::allocator_traits<Alloc>::template rebind_traits<unit>;
+    using unit_alloc = typename unit_traits::allocator_type;
+
+#if STRONG_PTR_BLOCK_CACHE
+    // Only the default allocator is replaced by the cache.
+    using use_cache = std::integral_constant<bool, strong_is_default_allocator<Alloc>::value && strong_block_cache::cacheable(sizeof(unit), align)>;
+
+    unit* allocate_units(std::size_t count, std::true_type /* cached */)
+    {
+        if (count * sizeof(unit) > strong_block_cache::max_size) return allocate_units(count, std::false_type());
+        return static_cast<unit*>(strong_block_cache::allocate(count * sizeof(unit)));
+    }
+    void deallocate_units(unit* mem, std::size_t count, std::true_type /* cached */)
+    {
+        if (count * sizeof(unit) > strong_block_cache::max_size) return deallocate_units(mem, count, std::false_type());
+        strong_block_cache::deallocate(mem, count * sizeof(unit));
+    }
+#else
+    using use_cache = std::false_type;
+#endif
+
+    unit* allocate_units(std::size_t count, std::false_type /* cached */)
+    {
+        unit_alloc alloc(m_alloc);
+        return unit_traits::allocate(alloc, count);
+    }
+    void deallocate_units(unit* mem, std::size_t count, std::false_type /* cached */)
+    {
+        unit_alloc alloc(m_alloc);
+        unit_traits::deallocate(alloc, mem, count);
+    }
+
+    static constexpr std::size_t offset(std::size_t n)
+    {
+        return (n * sizeof(V) + alignof(Block) - 1) / alignof(Block) * alignof(Block);
+    }
+    static constexpr std::size_t units(std::size_t n)
+    {
+        return (offset(n) + sizeof(Block) + sizeof(unit) - 1) / sizeof(unit);
+    }
+    static void* block_at(void* mem, std::size_t n)
+    {
+        return static_cast<unsigned char*>(mem) + offset(n);
+    }
+
+    static void release(strong_block* base)
+    {
+        Block* block = static_cast<Block*>(base);
+        assert(block->m_holds.load(std::memory_order_relaxed) == 0);
+        const std::size_t n = block->m_memory_count;
+        unit* mem = reinterpret_cast<unit*>(reinterpret_cast<unsigned char*>(block) - offset(n));
+        strong_block_allocator alloc(block->get_allocator(), nullptr, nullptr);
+        block->release_wake();
+        block->release_spare_anchor();
+        block->~Block();
+        alloc.deallocate_units(mem, units(n), use_cache());
+    }
+};
+
+/**
+ * Create the loan control block and its Block in a single allocation from
+ * alloc. build(void* mem, Alloc& alloc) constructs the Block at mem.
+ */
+template <typename Block, typename Alloc, typename Build>
+std::shared_ptr<strong_anchor> make_strong_block(const Alloc& alloc, Build build)
+{
+    strong_block* block = nullptr;
+    strong_block_allocator<strong_anchor, Block, Alloc, Build> anchor_alloc(alloc, &build, &block);
+    return std::allocate_shared<strong_anchor>(anchor_alloc, &block);
+}
+
+/** Hand a new block to its owner, returning the block. */
+template <typename T>
+strong_block* adopt_strong_block(std::shared_ptr<strong_anchor>&& owner, T* data)
+{
+    strong_block* block = owner->m_block;
+    block->set_data(data);
+    block->m_owner = std::move(owner);
+    return block;
+}
+
+/** Create a block owning ptr. The deleter is only moved from on success. */
+template <typename P, typename D, typename Deleter, typename Alloc = std::allocator<char>>
+std::shared_ptr<strong_anchor> make_strong_pointer_block(P ptr, Deleter&& deleter, const Alloc& alloc = Alloc())
+{
+    using block_type = strong_block_t<strong_pointer_block<P, D>, Alloc>;
+    return make_strong_block<block_type>(alloc, [&](void* mem, Alloc& a) { return ::new (mem) block_type(a, ptr, std::forward<Deleter>(deleter)); });
+}
+
+/** Create a block owning ptr, calling deleter(ptr) if that fails. */
+template <typename P, typename D, typename Alloc = std::allocator<char>>
+std::shared_ptr<strong_anchor> adopt_strong_pointer(P ptr, D& deleter, const Alloc& alloc = Alloc())
+{
+    try {
+        return make_strong_pointer_block<P, D>(ptr, std::move(deleter), alloc);
+    } catch (...) {
+        deleter(ptr);
+        throw;
+    }
+}
+
+/**
+ * A borrow of the object owned by a strong_ptr, see strong_ptr::borrow().
+ * Like a loan it holds off decay, but it costs no atomic operations, as it
+ * is only counted by the owner's thread. It must stay on that thread and
+ * end before the scope it was taken in does; use to_shared() to get a
+ * regular loan that may escape.
+ */
+template <typename T>
+class loan_ref
+{
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    loan_ref(strong_block* block, T* ptr) noexcept : m_block{block}, m_ptr{ptr}
+    {
+        if (m_block) ++m_block->m_borrows;
+    }
+
+public:
+    using element_type = T;
+
+    loan_ref(loan_ref&& rhs) noexcept : m_block{std::exchange(rhs.m_block, nullptr)}, m_ptr{std::exchange(rhs.m_ptr, nullptr)}
+    {
+    }
+
+    loan_ref(const loan_ref&) = delete;
+    loan_ref& operator=(const loan_ref&) = delete;
+    loan_ref& operator=(loan_ref&&) = delete;
+
+    ~loan_ref()
+    {
+        if (m_block) m_block->end_borrow();
+    }
+
+    /** Take a regular loan of the object, which may outlive this borrow. */
+    std::shared_ptr<T> to_shared() const
+    {
+        if (!m_block) return nullptr;
+        return std::shared_ptr<T>(m_block->owner_loan(), m_ptr);
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_block* m_block;
+    T* m_ptr;
+};
+
+/**
+ * A loan of the object owned by a strong_ptr<T, single_thread>. It is counted
+ * like a borrow, without atomics, so it and its copies must stay on the
+ * owner's thread; unlike a borrow, it may be copied and kept around.
+ */
+template <typename T>
+class local_loan
+{
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    local_loan(strong_block* block, T* ptr) noexcept : m_block{block}, m_ptr{ptr}
+    {
+        if (m_block) ++m_block->m_borrows;
+    }
+
+public:
+    using element_type = T;
+
+    constexpr local_loan() noexcept = default;
+    constexpr local_loan(std::nullptr_t) noexcept {}
+
+    local_loan(const local_loan& rhs) noexcept : local_loan(rhs.m_block, rhs.m_ptr)
+    {
+    }
+    local_loan(local_loan&& rhs) noexcept : m_block{std::exchange(rhs.m_block, nullptr)}, m_ptr{std::exchange(rhs.m_ptr, nullptr)}
+    {
+    }
+
+    local_loan& operator=(local_loan rhs) noexcept
+    {
+        rhs.swap(*this);
+        return *this;
+    }
+
+    ~local_loan()
+    {
+        if (m_block) m_block->end_borrow();
+    }
+
+    void swap(local_loan& rhs) noexcept
+    {
+        std::swap(m_block, rhs.m_block);
+        std::swap(m_ptr, rhs.m_ptr);
+    }
+
+    void reset()
+    {
+        local_loan().swap(*this);
+    }
+
+    /** Take a regular loan of the object, which may leave the thread. */
+    std::shared_ptr<T> to_shared() const
+    {
+        if (!m_block) return nullptr;
+        return std::shared_ptr<T>(m_block->owner_loan(), m_ptr);
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_block* m_block{nullptr};
+    T* m_ptr{nullptr};
+};
+
+/**
+ * A number of loans of the object owned by a strong_ptr, taken at once with
+ * strong_ptr::get_shared_n(). They are counted together, so taking them is
+ * a single atomic addition and returning them a single subtraction, however
+ * many there are. split() hands some of them to a batch of their own, e.g.
+ * one per worker, and merge() gathers them back, neither of which touches
+ * the shared count. Like loans, batches may be moved to and released by any
+ * thread, and hold off decay until the last of them is gone.
+ */
+template <typename T>
+class loan_batch
+{
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    loan_batch(strong_block* block, T* ptr, std::size_t count) noexcept : m_block{block}, m_ptr{ptr}, m_count{count}
+    {
+    }
+
+public:
+    using element_type = T;
+
+    constexpr loan_batch() noexcept = default;
+
+    loan_batch(loan_batch&& rhs) noexcept : m_block{std::exchange(rhs.m_block, nullptr)}, m_ptr{std::exchange(rhs.m_ptr, nullptr)}, m_count{std::exchange(rhs.m_count, 0)}
+    {
+    }
+
+    loan_batch(const loan_batch&) = delete;
+    loan_batch& operator=(const loan_batch&) = delete;
+
+    loan_batch& operator=(loan_batch&& rhs) noexcept
+    {
+        loan_batch(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    ~loan_batch()
+    {
+        if (m_count) m_block->release_batch(m_count);
+    }
+
+    void swap(loan_batch& rhs) noexcept
+    {
+        std::swap(m_block, rhs.m_block);
+        std::swap(m_ptr, rhs.m_ptr);
+        std::swap(m_count, rhs.m_count);
+    }
+
+    void reset()
+    {
+        loan_batch().swap(*this);
+    }
+
+    /** Move count of the loans into a new batch. */
+    loan_batch split(std::size_t count = 1)
+    {
+        assert(count <= m_count);
+        loan_batch result(m_block, m_ptr, count);
+        m_count -= count;
+        if (!m_count) {
+            m_block = nullptr;
+            m_ptr = nullptr;
+        }
+        return result;
+    }
+
+    /** Take over the loans of rhs, which must be of the same object. */
+    void merge(loan_batch&& rhs)
+    {
+        if (!m_count) {
+            swap(rhs);
+        } else if (rhs.m_count) {
+            assert(rhs.m_block == m_block);
+            m_count += std::exchange(rhs.m_count, 0);
+            rhs.reset();
+        }
+    }
+
+    std::size_t size() const
+    {
+        return m_count;
+    }
+
+    T& operator*() const
+    {
+        return *m_ptr;
+    }
+    T* operator->() const
+    {
+        return m_ptr;
+    }
+    T* get() const
+    {
+        return m_ptr;
+    }
+    explicit operator bool() const
+    {
+        return m_ptr != nullptr;
+    }
+
+private:
+    strong_block* m_block{nullptr};
+    T* m_ptr{nullptr};
+    std::size_t m_count{0};
+};
+
+/**
+ * A loan of a range of the elements of a strong_ptr<T[]>, see
+ * strong_ptr<T[]>::get_shared(offset, length). However short the range, it
+ * holds off the decay of the whole array. Subslices share the same loan.
+ */
+template <typename T, typename Policy = multi_thread>
+class loan_slice
+{
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    using loan_type = typename Policy::template loan<T>;
+
+    loan_slice(loan_type loan, T* data, std::size_t size) noexcept : m_loan(std::move(loan)), m_data{data}, m_size{size} {}
+
+public:
+    using element_type = T;
+    using iterator = T*;
+
+    loan_slice() = default;
+
+    /** Elements offset to offset + length of this slice, sharing its loan. */
+    loan_slice subslice(std::size_t offset, std::size_t length) const
+    {
+        assert(offset <= m_size && length <= m_size - offset);
+        return loan_slice(m_loan, m_data + offset, length);
+    }
+
+    void reset()
+    {
+        *this = loan_slice();
+    }
+
+    T* data() const
+    {
+        return m_data;
+    }
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+    T* begin() const
+    {
+        return m_data;
+    }
+    T* end() const
+    {
+        return m_data + m_size;
+    }
+    T& operator[](std::size_t i) const
+    {
+        assert(i < m_size);
+        return m_data[i];
+    }
+    /** Whether this holds a loan, even of an empty range. */
+    explicit operator bool() const
+    {
+        return static_cast<bool>(m_loan);
+    }
+
+private:
+    loan_type m_loan;
+    T* m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+/**
+ * A weak reference to the object owned by a strong_ptr, see
+ * strong_ptr::get_weak(). It doesn't hold off decay: lock() hands out a
+ * loan only while the object still has its owner, and fails for good once
+ * the owner has let go, whether or not other loans remain.
+ */
+template <typename T>
+class weak_loan
+{
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    weak_loan(strong_weak_tether* tether, T* ptr) noexcept : m_tether{tether}, m_ptr{ptr} {}
+
+public:
+    using element_type = T;
+
+    constexpr weak_loan() noexcept = default;
+
+    weak_loan(const weak_loan& rhs) noexcept : m_tether{rhs.m_tether}, m_ptr{rhs.m_ptr}
+    {
+        if (m_tether) m_tether->add_ref();
+    }
+    weak_loan(weak_loan&& rhs) noexcept : m_tether{std::exchange(rhs.m_tether, nullptr)}, m_ptr{std::exchange(rhs.m_ptr, nullptr)} {}
+
+    weak_loan& operator=(weak_loan rhs) noexcept
+    {
+        rhs.swap(*this);
+        return *this;
+    }
+
+    ~weak_loan()
+    {
+        if (m_tether) m_tether->release_ref();
+    }
+
+    void swap(weak_loan& rhs) noexcept
+    {
+        std::swap(m_tether, rhs.m_tether);
+        std::swap(m_ptr, rhs.m_ptr);
+    }
+
+    void reset()
+    {
+        weak_loan().swap(*this);
+    }
+
+    /** A loan of the object, or null if its owner has let go of it. */
+    std::shared_ptr<T> lock() const
+    {
+        if (!m_tether) return nullptr;
+        std::shared_ptr<strong_anchor> anchor = m_tether->lock();
+        if (!anchor) return nullptr;
+#if STRONG_PTR_INSTRUMENT
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) sink->on_loan(m_ptr);
+#endif
+        return std::shared_ptr<T>(anchor, m_ptr);
+    }
+
+    /** Whether lock() would fail. */
+    bool expired() const
+    {
+        return !m_tether || m_tether->expired();
+    }
+
+private:
+    strong_weak_tether* m_tether{nullptr};
+    T* m_ptr{nullptr};
 };
 
-template <typename T>
+template <typename T, typename Policy>
 class strong_ptr
 {
-    struct shared_deleter {
-        void operator()(T* /* unused */)
-        {
-            assert(m_wake);
-            m_data.reset();
-            {
-                // Necessary dummy lock
-                std::lock_guard<std::mutex> lock(m_wake->m_mut);
-            }
-            m_wake->m_cond.notify_all();
-        }
-        std::shared_ptr<void> m_data;
-        std::shared_ptr<wake_type> m_wake;
-    };
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    template <typename U, typename P>
+    friend class decay_ptr;
 
-    friend class decay_ptr<T>;
+    template <typename U, typename Alloc, typename... Args>
+    friend strong_ptr<U> allocate_strong(const Alloc& alloc, Args&&... args);
 
-    template <typename U, typename... Args>
-    friend strong_ptr<U> make_strong(Args&&... args);
+    explicit strong_ptr(strong_block* block) noexcept : m_block{block}
+    {
+    }
 
     template <typename U>
-    explicit strong_ptr(std::shared_ptr<U>&& rhs) : m_data{std::move(rhs)}
+    static strong_block* convert(strong_block* block)
     {
+        if (block) block->set_data(static_cast<T*>(block->data<U>()));
+        return block;
     }
 
 public:
     using element_type = T;
+    using loan_type = typename Policy::template loan<T>;
 
     constexpr strong_ptr() : strong_ptr(nullptr) {}
 
-    constexpr strong_ptr(std::nullptr_t) : m_shared{nullptr}, m_wake{std::make_shared<wake_type>()} {}
+    constexpr strong_ptr(std::nullptr_t) : m_block{nullptr} {}
 
     template <typename U>
-    explicit strong_ptr(U* ptr) : m_data(ptr), m_wake{std::make_shared<wake_type>()}
+    explicit strong_ptr(U* ptr) : strong_ptr(ptr, std::default_delete<U>())
     {
     }
 
     template <typename Deleter>
-    strong_ptr(std::nullptr_t ptr, Deleter deleter) : m_data{ptr, std::move(deleter)}, m_wake{std::make_shared<wake_type>()}
+    strong_ptr(std::nullptr_t ptr, Deleter deleter) : m_block{adopt_strong_block(adopt_strong_pointer(ptr, deleter), static_cast<T*>(nullptr))}
     {
     }
 
     template <typename U, typename Deleter>
-    strong_ptr(U* ptr, Deleter deleter) : m_data{ptr, std::move(deleter)}, m_wake{std::make_shared<wake_type>()}
+    strong_ptr(U* ptr, Deleter deleter) : m_block{adopt_strong_block(adopt_strong_pointer(ptr, deleter), static_cast<T*>(ptr))}
+    {
+    }
+
+    // As with std::shared_ptr, alloc is used for all of the bookkeeping but
+    // not for the object, which is released by the deleter.
+
+    template <typename Deleter, typename Alloc>
+    strong_ptr(std::nullptr_t ptr, Deleter deleter, Alloc alloc) : m_block{adopt_strong_block(adopt_strong_pointer(ptr, deleter, alloc), static_cast<T*>(nullptr))}
+    {
+    }
+
+    template <typename U, typename Deleter, typename Alloc>
+    strong_ptr(U* ptr, Deleter deleter, Alloc alloc) : m_block{adopt_strong_block(adopt_strong_pointer(ptr, deleter, alloc), static_cast<T*>(ptr))}
     {
     }
 
     template <typename U, typename Deleter>
-    strong_ptr(std::unique_ptr<U, Deleter>&& rhs) : m_data{std::move(rhs)}, m_wake{std::make_shared<wake_type>()}
+    strong_ptr(std::unique_ptr<U, Deleter>&& rhs) : m_block{nullptr}
     {
-        assert(m_wake);
+        if (rhs) {
+            T* data = rhs.get();
+            m_block = adopt_strong_block(make_strong_pointer_block<typename std::unique_ptr<U, Deleter>::pointer, strong_deleter_t<Deleter>>(rhs.get(), std::forward<Deleter>(rhs.get_deleter())), data);
+            rhs.release();
+        }
     }
 
-    template <typename U>
-    strong_ptr(strong_ptr<U>&& rhs) : m_data{std::move(rhs.m_data)}, m_wake{std::move(rhs.m_wake)}, m_shared{std::move(rhs.m_shared)}
+    // Both policies share the same bookkeeping, so a pointer may switch
+    // between them, as long as it is the only reference to the object.
+    template <typename U, typename P>
+    strong_ptr(strong_ptr<U, P>&& rhs) : m_block{convert<U>(std::exchange(rhs.m_block, nullptr))}
     {
     }
-    strong_ptr(strong_ptr&& rhs) noexcept : m_data{std::move(rhs.m_data)}, m_wake{std::move(rhs.m_wake)}, m_shared{std::move(rhs.m_shared)} {}
+    strong_ptr(strong_ptr&& rhs) noexcept : m_block{std::exchange(rhs.m_block, nullptr)} {}
 
-    ~strong_ptr() = default;
+    ~strong_ptr()
+    {
+        if (m_block) m_block->release_owner();
+    }
 
     strong_ptr(const strong_ptr& rhs) = delete;
     strong_ptr& operator=(const strong_ptr& rhs) = delete;
 
     strong_ptr& operator=(strong_ptr&& rhs) noexcept
     {
-        m_data = std::move(rhs.m_data);
-        m_wake = std::move(rhs.m_wake);
-        m_shared = std::move(rhs.m_shared);
+        strong_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
 
-    template <typename U>
-    strong_ptr& operator=(strong_ptr<U>&& rhs)
+    template <typename U, typename P>
+    strong_ptr& operator=(strong_ptr<U, P>&& rhs)
     {
-        m_data = std::move(rhs.m_data);
-        m_wake = std::move(rhs.m_wake);
-        m_shared = std::move(rhs.m_shared);
+        strong_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
 
@@ -113,17 +2094,18 @@ public:
     template <typename U, typename Deleter>
     strong_ptr& operator=(std::unique_ptr<U, Deleter>&& rhs)
     {
-        m_data = std::move(rhs);
-        m_wake = std::make_shared<wake_type>();
-        m_shared.reset(nullptr, shared_deleter{m_data, m_wake});
+        strong_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
 
+    void swap(strong_ptr& rhs) noexcept
+    {
+        std::swap(m_block, rhs.m_block);
+    }
+
     void reset()
     {
-        m_data.reset();
-        m_shared.reset();
-        m_wake = std::make_shared<wake_type>();
+        strong_ptr().swap(*this);
     }
     void reset(std::nullptr_t)
     {
@@ -132,68 +2114,361 @@ public:
     template <typename U>
     void reset(U* ptr)
     {
-        m_data.reset(ptr);
-        m_wake = std::make_shared<wake_type>();
-        m_shared.reset(nullptr, shared_deleter{m_data, m_wake});
+        strong_ptr(ptr).swap(*this);
     }
     template <typename U, typename Deleter>
     void reset(U* ptr, Deleter deleter)
     {
-        m_data.reset(ptr, std::move(deleter));
-        m_wake = std::make_shared<wake_type>();
-        m_shared.reset(nullptr, shared_deleter{m_data, m_wake});
+        strong_ptr(ptr, std::move(deleter)).swap(*this);
+    }
+    template <typename U, typename Deleter, typename Alloc>
+    void reset(U* ptr, Deleter deleter, Alloc alloc)
+    {
+        strong_ptr(ptr, std::move(deleter), std::move(alloc)).swap(*this);
+    }
+#if STRONG_PTR_INSTRUMENT >= 2
+    loan_type get_shared(strong_loan_site site = strong_loan_site::current()) const
+    {
+        loan_type loan = make_loan(Policy(), m_block ? m_block->data<T>() : nullptr);
+        if (m_block) strong_loan_registry::record(m_block->m_data, site);
+        return loan;
+    }
+#else
+    loan_type get_shared() const
+    {
+        return make_loan(Policy(), m_block ? m_block->data<T>() : nullptr);
+    }
+#endif
+
+    /**
+     * Loans of a part of the object: the data member pointed to by member,
+     * or the object which projection(T&) returns a reference to. They count
+     * as loans of the whole object, holding off its decay exactly like
+     * get_shared(), but only give access to the part. Both are null if this
+     * is.
+     */
+    template <typename M, typename C, typename = typename std::enable_if<!std::is_function<M>::value>::type>
+    typename Policy::template loan<M> get_shared(M C::*member) const
+    {
+        return make_loan(Policy(), m_block ? &(m_block->data<T>()->*member) : nullptr);
+    }
+    template <typename Projection, typename = typename std::enable_if<!std::is_member_pointer<Projection>::value>::type>
+    typename Policy::template loan<typename std::remove_reference<decltype(std::declval<Projection&>()(std::declval<T&>()))>::type> get_shared(Projection projection) const
+    {
+        using part = decltype(projection(std::declval<T&>()));
+        static_assert(std::is_lvalue_reference<part>::value, "projection must return a reference into the object");
+        return make_loan(Policy(), m_block ? std::addressof(projection(*m_block->data<T>())) : nullptr);
+    }
+
+    /**
+     * Retire the object: start its decay and hand the resulting decay_ptr to
+     * callback once it has decayed, as with decay_ptr::on_decay(). Unless
+     * the callback keeps the decay_ptr (to rearm it, say), the object is
+     * destroyed when the callback returns, in whichever thread the executor
+     * ran it on.
+     */
+    template <typename Callback>
+    void retire(Callback callback)
+    {
+        strong_block* block = m_block;
+        decay_ptr<T, Policy>::schedule(block, retire_task(std::move(callback)));
+    }
+    template <typename Callback, typename Executor>
+    void retire(Callback callback, Executor executor)
+    {
+        strong_block* block = m_block;
+        decay_ptr<T, Policy>::schedule(block, retire_task(std::move(callback)), std::move(executor));
+    }
+
+    /**
+     * A weak loan of the object, which can be upgraded to a loan for as long
+     * as this (or whichever strong_ptr it is moved to) owns the object. It
+     * doesn't hold off decay, so e.g. caches can keep them without stalling
+     * retirement. The first weak loan of an object allocates what they
+     * refer to, which is released with the last of them.
+     */
+    weak_loan<T> get_weak() const
+    {
+        if (!m_block) return weak_loan<T>();
+        return weak_loan<T>(m_block->weak_tether(), m_block->data<T>());
+    }
+
+    /**
+     * Take count loans at once, with a single atomic addition. Returns an
+     * empty batch if this is null or count is zero.
+     */
+    loan_batch<T> get_shared_n(std::size_t count) const
+    {
+        if (!m_block || !count) return loan_batch<T>();
+        m_block->take_batch(count);
+#if STRONG_PTR_INSTRUMENT
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) sink->on_loans(m_block->m_data, count);
+#endif
+        return loan_batch<T>(m_block, m_block->data<T>(), count);
+    }
+
+    /**
+     * Borrow the object for the current scope. This holds off decay like
+     * get_shared(), but is counted with plain integer operations instead of
+     * atomic ones, so it must only be used by the thread owning this
+     * strong_ptr: the borrow has to end on that same thread, before the
+     * strong_ptr is handed to another one.
+     */
+    loan_ref<T> borrow() const
+    {
+#if STRONG_PTR_INSTRUMENT
+        strong_ptr_sink* sink = strong_ptr_instrument::sink();
+        if (m_block && sink) sink->on_loan(m_block->m_data);
+#endif
+        return loan_ref<T>(m_block, m_block ? m_block->data<T>() : nullptr);
     }
-    std::shared_ptr<T> get_shared() const
+
+    /**
+     * Spread future loans over count shards. Each shard counts its loans in
+     * its own control block, on its own cache line, and get_shared() picks
+     * one based on the calling thread. This keeps threads taking loans of a
+     * hot object from contending on one counter, at the cost of one
+     * allocation per shard. The shards only need to be combined when
+     * decaying, which happens as each of them runs out of loans.
+     *
+     * Like reset(), this must not race with get_shared().
+     */
+    void enable_sharding(std::size_t count)
     {
-        return std::shared_ptr<T>(m_shared, m_data.get());
+        assert(m_block && count > 0);
+        std::unique_ptr<strong_shards> shards(new strong_shards);
+        shards->m_loans.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            shards->m_loans.push_back(std::make_shared<strong_shard_anchor>(m_block->m_owner));
+        }
+        m_block->m_shards = std::move(shards);
     }
     T* operator*()
     {
-        return m_data.operator*();
+        return *get();
     }
     const T* operator*() const
     {
-        return m_data.operator*();
+        return *get();
     }
     T* operator->()
     {
-        return m_data.operator->();
+        return get();
     }
     const T* operator->() const
     {
-        return m_data.operator->();
+        return get();
     }
     const T* get() const
     {
-        return m_data.get();
+        return m_block ? m_block->data<T>() : nullptr;
     }
     T* get()
     {
-        return m_data.get();
+        return m_block ? m_block->data<T>() : nullptr;
     }
     explicit operator bool() const
     {
-        return m_data.operator bool();
+        return get() != nullptr;
     }
 
 private:
-    std::shared_ptr<T> m_data;
-    std::shared_ptr<wake_type> m_wake;
-    std::shared_ptr<void> m_shared{nullptr, shared_deleter{m_data, m_wake}};
+    template <typename Callback>
+    strong_decay_task retire_task(Callback callback)
+    {
+        return strong_decay_task([callback = std::move(callback), degraded = decay_ptr<T, Policy>(std::move(*this))]() mutable {
+            callback(std::move(degraded));
+        });
+    }
+
+    /** A loan of the object, handing out ptr, which must lie within it. */
+    template <typename U>
+    std::shared_ptr<U> make_loan(multi_thread, U* ptr) const
+    {
+        if (!m_block) return nullptr;
+#if STRONG_PTR_INSTRUMENT
+        if (strong_ptr_sink* sink = strong_ptr_instrument::sink()) sink->on_loan(m_block->m_data);
+#endif
+        if (m_block->m_shards) return std::shared_ptr<U>(m_block->m_shards->pick(), ptr);
+        return std::shared_ptr<U>(m_block->m_owner, ptr);
+    }
+    template <typename U>
+    local_loan<U> make_loan(single_thread, U* ptr) const
+    {
+#if STRONG_PTR_INSTRUMENT
+        strong_ptr_sink* sink = strong_ptr_instrument::sink();
+        if (m_block && sink) sink->on_loan(m_block->m_data);
+#endif
+        return local_loan<U>(m_block, ptr);
+    }
+    strong_block* m_block;
 };
 
-template <typename T>
+#if STRONG_PTR_COROUTINES
+/**
+ * Resumes a coroutine waiting for a decay, through executor unless it is
+ * strong_inline_executor.
+ */
+inline strong_decay_task strong_resume_task(std::coroutine_handle<> handle, strong_inline_executor)
+{
+    return strong_decay_task([handle] { handle.resume(); });
+}
+template <typename Executor>
+strong_decay_task strong_resume_task(std::coroutine_handle<> handle, Executor executor)
+{
+    return strong_decay_task([handle, executor = std::move(executor)]() mutable {
+        executor(strong_decay_task([handle] { handle.resume(); }));
+    });
+}
+
+/**
+ * What decay_ptr::decayed_async() returns. Suspending registers the resumption
+ * as the decay callback, so the coroutine is resumed exactly once by whoever
+ * releases the last loan, with a single atomic operation on either side.
+ */
+template <typename Executor>
+class strong_decay_awaiter
+{
+public:
+    strong_decay_awaiter(strong_decay_state* state, Executor executor) : m_state{state}, m_executor(std::move(executor)) {}
+
+    bool await_ready() const
+    {
+        return !m_state || m_state->decayed();
+    }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        if (m_state->try_set_on_decay(strong_resume_task(handle, std::move(m_executor)))) return true;
+        // Decayed in the meantime: drop the resumption and carry on.
+        m_state->m_on_decay = strong_decay_task();
+        return false;
+    }
+    void await_resume() const {}
+
+private:
+    strong_decay_state* m_state;
+    Executor m_executor;
+};
+
+/**
+ * What decay_ptr::decayed_async_until() returns: races the decay against a
+ * timeout, resuming the coroutine once with whichever comes first. Coroutines
+ * have no standard timer, so timer is any callable taking the timeout and a
+ * strong_decay_task to run then, e.g. one scheduling it on an event loop.
+ *
+ * A timeout takes the decay callback back out of the block, so the wait can
+ * be retried, or another callback set, once it has returned.
+ */
+template <typename TimePoint, typename Timer>
+class strong_timed_decay_awaiter
+{
+    struct race {
+        static constexpr int pending = 0;
+        // The timer is trying to take back the decay callback.
+        static constexpr int timing_out = 1;
+        // The decay callback came while it was: the timer resumes.
+        static constexpr int handed_over = 2;
+        static constexpr int done = 3;
+
+        void decayed()
+        {
+            int phase = pending;
+            if (m_phase.compare_exchange_strong(phase, done, std::memory_order_acq_rel)) {
+                resume(std::cv_status::no_timeout);
+            } else {
+                m_phase.store(handed_over, std::memory_order_release);
+            }
+        }
+        void timed_out()
+        {
+            // Once the coroutine has been resumed, the block may be gone.
+            int phase = pending;
+            if (!m_phase.compare_exchange_strong(phase, timing_out, std::memory_order_acq_rel)) return;
+            if (m_state->try_take_on_decay()) {
+                resume(std::cv_status::timeout);
+                return;
+            }
+            // Decayed first. Its callback is about to run, and resumes unless
+            // it already came while we were looking.
+            phase = timing_out;
+            if (m_phase.compare_exchange_strong(phase, pending, std::memory_order_acq_rel)) return;
+            resume(std::cv_status::no_timeout);
+        }
+        void resume(std::cv_status status)
+        {
+            m_status = status;
+            m_handle.resume();
+        }
+
+        std::atomic<int> m_phase{pending};
+        strong_decay_state* m_state;
+        std::coroutine_handle<> m_handle;
+        std::cv_status m_status{std::cv_status::no_timeout};
+    };
+
+public:
+    strong_timed_decay_awaiter(strong_decay_state* state, const TimePoint& timeout_time, Timer timer) : m_state{state}, m_timeout_time(timeout_time), m_timer(std::move(timer)) {}
+
+    bool await_ready() const
+    {
+        return !m_state || m_state->decayed();
+    }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        m_race = std::make_shared<race>();
+        m_race->m_state = m_state;
+        m_race->m_handle = handle;
+        // Once the decay callback is set, the coroutine and with it this
+        // awaiter may be gone at any moment, so take what is needed first.
+        std::shared_ptr<race> timed = m_race;
+        Timer timer(std::move(m_timer));
+        const TimePoint timeout_time = m_timeout_time;
+        if (!m_state->try_set_on_decay(strong_decay_task([r = m_race] { r->decayed(); }))) {
+            m_state->m_on_decay = strong_decay_task();
+            m_race.reset();
+            return false;
+        }
+        timer(timeout_time, strong_decay_task([timed] { timed->timed_out(); }));
+        return true;
+    }
+    std::cv_status await_resume() const
+    {
+        return m_race ? m_race->m_status : std::cv_status::no_timeout;
+    }
+
+private:
+    strong_decay_state* m_state;
+    TimePoint m_timeout_time;
+    Timer m_timer;
+    std::shared_ptr<race> m_race;
+};
+#endif
+
+template <typename T, typename Policy>
 class decay_ptr
 {
+    template <typename U, typename P>
+    friend class decay_ptr;
+
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    template <typename U>
+    static strong_block* convert(strong_block* block)
+    {
+        if (block) block->set_data(static_cast<T*>(block->data<U>()));
+        return block;
+    }
+
 public:
     constexpr decay_ptr() = default;
     constexpr decay_ptr(std::nullptr_t) : decay_ptr{} {}
-    decay_ptr(decay_ptr&& rhs) noexcept : m_data{std::move(rhs.m_data)}, m_decaying{std::move(rhs.m_decaying)}, m_wake{std::move(rhs.m_wake)}
+    decay_ptr(decay_ptr&& rhs) noexcept : m_block{std::exchange(rhs.m_block, nullptr)}
     {
     }
 
     template <typename U>
-    decay_ptr(decay_ptr<U>&& rhs) : m_data{std::move(rhs.m_data)}, m_decaying{std::move(rhs.m_decaying)}, m_wake{std::move(rhs.m_wake)}
+    decay_ptr(decay_ptr<U, Policy>&& rhs) : m_block{convert<U>(std::exchange(rhs.m_block, nullptr))}
     {
     }
 
@@ -201,136 +2476,483 @@ public:
     decay_ptr& operator=(const decay_ptr&) = delete;
 
     template <typename U>
-    decay_ptr(strong_ptr<U>&& ptr) : m_data{std::move(ptr.m_data)}, m_decaying{ptr.m_shared}, m_wake{std::move(ptr.m_wake)}
+    decay_ptr(strong_ptr<U, Policy>&& ptr) : m_block{convert<U>(std::exchange(ptr.m_block, nullptr))}
     {
-        assert(m_wake);
-        ptr.m_shared.reset();
+        if (m_block) m_block->start_decay();
     }
 
-    ~decay_ptr() = default;
+    ~decay_ptr()
+    {
+        if (m_block) m_block->release_observer();
+    }
 
     template <typename U>
-    decay_ptr& operator=(decay_ptr<U>&& rhs)
+    decay_ptr& operator=(decay_ptr<U, Policy>&& rhs)
     {
-        m_data = std::move(rhs.m_data);
-        m_wake = std::move(rhs.m_wake);
-        m_decaying = std::move(rhs.m_decaying);
+        decay_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
     decay_ptr& operator=(decay_ptr&& rhs) noexcept
     {
-        m_data = std::move(rhs.m_data);
-        m_wake = std::move(rhs.m_wake);
-        m_decaying = std::move(rhs.m_decaying);
+        decay_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
     template <typename U>
-    decay_ptr& operator=(strong_ptr<U>&& rhs)
+    decay_ptr& operator=(strong_ptr<U, Policy>&& rhs)
     {
-        m_data = std::move(rhs.m_data);
-        m_wake = std::move(rhs.m_wake);
-        m_decaying = rhs.m_shared;
-        rhs.m_shared.reset();
-        rhs.m_wake.reset();
+        decay_ptr(std::move(rhs)).swap(*this);
         return *this;
     }
+    void swap(decay_ptr& rhs) noexcept
+    {
+        std::swap(m_block, rhs.m_block);
+    }
     bool decayed() const
     {
-        return m_decaying.expired();
+        return !m_block || m_block->decayed();
     }
 
+    // The waits without a predicate return as soon as the pointer has
+    // decayed, checking for it under the lock so that no wakeup is missed.
+    // Spurious wakeups are absorbed. The ones taking a predicate wait for
+    // it to become true, rechecking when the pointer decays.
+    //
+    // Without wake state there is nothing left to wait for: either there
+    // never were any loans, or they are all gone already.
+    //
+    // With the single_thread policy, only the waiting thread could release
+    // the loans, so the waits never block: they return right away, and the
+    // ones without a timeout assert that there was nothing to wait for.
+
     void wait()
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        m_wake->m_cond.wait(lock);
+        if (poll_only) {
+            assert(decayed());
+            return;
+        }
+        if (!m_block) return;
+#if STRONG_PTR_INSTRUMENT
+        strong_wait_timer timer(get());
+#endif
+        m_block->wait_decayed();
+    }
+
+    /** Spin as described by policy, then block if still not decayed. */
+    void wait(const spin_then_block& policy)
+    {
+        if (!policy.spin([this] { return decayed(); })) wait();
     }
 
+    /**
+     * Block until stop_waiting() returns true or the pointer has decayed,
+     * whichever comes first. stop_waiting is only rechecked when the
+     * pointer decays (or on spurious wakeups), so if something else makes
+     * it true, the wait notices no sooner than that. The timed versions
+     * return what stop_waiting() last returned.
+     */
     template<class Predicate>
     void wait(Predicate stop_waiting)
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        m_wake->m_cond.wait(lock, stop_waiting);
+        if (poll_only) {
+            assert(stop_waiting());
+            return;
+        }
+        if (!m_block) return;
+#if STRONG_PTR_INSTRUMENT
+        strong_wait_timer timer(get());
+#endif
+        m_block->wait(stop_waiting);
     }
 
     template<class Rep, class Period, class Predicate>
     bool wait_for(const std::chrono::duration<Rep, Period>& rel_time, Predicate stop_waiting)
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        return m_wake->m_cond.wait_for(lock, rel_time, stop_waiting);
+        if (poll_only || !m_block) return stop_waiting();
+#if STRONG_PTR_INSTRUMENT
+        strong_wait_timer timer(get());
+#endif
+        return m_block->wait_for(rel_time, stop_waiting);
     }
 
     template<class Rep, class Period>
     std::cv_status wait_for(const std::chrono::duration<Rep, Period>& rel_time)
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        return m_wake->m_cond.wait_for(lock, rel_time);
+        return wait_for(rel_time, [this] { return decayed(); }) ? std::cv_status::no_timeout : std::cv_status::timeout;
     }
 
     template<class Clock, class Duration>
     std::cv_status wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time)
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        return m_wake->m_cond.wait_until(lock, timeout_time);
+        return wait_until(timeout_time, [this] { return decayed(); }) ? std::cv_status::no_timeout : std::cv_status::timeout;
     }
 
     template<class Clock, class Duration, class Predicate>
     bool wait_until(const std::chrono::time_point<Clock, Duration>& timeout_time, Predicate stop_waiting)
     {
-        assert(m_wake);
-        std::unique_lock<std::mutex> lock(m_wake->m_mut);
-        return m_wake->m_cond.wait_until(lock, timeout_time, stop_waiting);
+        if (poll_only || !m_block) return stop_waiting();
+#if STRONG_PTR_INSTRUMENT
+        strong_wait_timer timer(get());
+#endif
+        return m_block->wait_until(timeout_time, stop_waiting);
     }
 
     void reset()
     {
-        m_decaying.reset();
-        m_data.reset();
-        m_wake.reset();
+        decay_ptr().swap(*this);
+    }
+
+    /**
+     * Run callback once the pointer has decayed, without anybody having to
+     * wait for it. It runs right away if the pointer has already decayed (or
+     * is null), and otherwise on the thread releasing the last loan, while
+     * the object is still alive (as long as this is). Pass an executor, which
+     * is handed the callback as a strong_decay_task, to run it elsewhere
+     * instead, e.g. to move heavy work off the releasing thread. The callback
+     * must not throw.
+     *
+     * Only one callback can be set per decay.
+     */
+    template <typename Callback>
+    void on_decay(Callback callback)
+    {
+        schedule(m_block, strong_decay_task(std::move(callback)));
+    }
+    template <typename Callback, typename Executor>
+    void on_decay(Callback callback, Executor executor)
+    {
+        schedule(m_block, strong_decay_task(std::move(callback)), std::move(executor));
+    }
+
+#if STRONG_PTR_COROUTINES
+    /**
+     * co_await the result to suspend until the pointer has decayed. The
+     * coroutine is resumed on the thread releasing the last loan, or through
+     * executor when one is given, as with on_decay(), whose single callback
+     * slot this uses. The pointer must outlive the wait.
+     */
+    strong_decay_awaiter<strong_inline_executor> decayed_async()
+    {
+        return strong_decay_awaiter<strong_inline_executor>(m_block, strong_inline_executor());
+    }
+    template <typename Executor>
+    strong_decay_awaiter<Executor> decayed_async(Executor executor)
+    {
+        return strong_decay_awaiter<Executor>(m_block, std::move(executor));
+    }
+
+    /**
+     * Like decayed_async(), giving up at timeout_time as scheduled by timer,
+     * see strong_timed_decay_awaiter. co_await yields a std::cv_status, as
+     * wait_until() returns. After a timeout it can be awaited again, or
+     * another decay callback set.
+     */
+    template <class Clock, class Duration, typename Timer>
+    strong_timed_decay_awaiter<std::chrono::time_point<Clock, Duration>, Timer> decayed_async_until(const std::chrono::time_point<Clock, Duration>& timeout_time, Timer timer)
+    {
+        return {m_block, timeout_time, std::move(timer)};
+    }
+    template <class Rep, class Period, typename Timer>
+    strong_timed_decay_awaiter<std::chrono::steady_clock::time_point, Timer> decayed_async_for(const std::chrono::duration<Rep, Period>& rel_time, Timer timer)
+    {
+        return {m_block, std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(rel_time), std::move(timer)};
+    }
+#endif
+
+    /**
+     * Turn a decayed pointer back into a strong_ptr to the same object, so
+     * that it can be loaned out again. The block and its wake state are
+     * reused, and the control block counting the new loans takes the memory
+     * of the previous rearm's, so that recycling an object allocates nothing
+     * from the second rearm on. The exception is a rearm that comes before
+     * the thread releasing the last loan is done with that control block,
+     * which allocates a new one. This must not be called before the pointer
+     * has decayed.
+     */
+    strong_ptr<T, Policy> rearm()
+    {
+        assert(decayed());
+        strong_block* block = std::exchange(m_block, nullptr);
+        if (block) block->rearm();
+        return strong_ptr<T, Policy>(block);
     }
+    /**
+     * Hand a decayed object over to a std::unique_ptr, without moving it, and
+     * free all of the bookkeeping right away. This only works for objects
+     * that were handed to the strong_ptr as a pointer with a deleter of type
+     * D, e.g. strong_ptr<T>(new T) or a std::unique_ptr<T, D>; objects from
+     * make_strong() share their allocation with the bookkeeping. Otherwise,
+     * or before the pointer has decayed, this returns null and keeps the
+     * object.
+     */
+    template <typename D = std::default_delete<T>>
+    std::unique_ptr<T, D> release_unique()
+    {
+        using pointer = typename std::unique_ptr<T, D>::pointer;
+        if (!m_block || !decayed()) return nullptr;
+        typename std::aligned_storage<sizeof(D), alignof(D)>::type storage;
+        if (!m_block->release_pointer(strong_type_tag<pointer, D>(), &storage)) return nullptr;
+        D& deleter = *reinterpret_cast<D*>(&storage);
+        std::unique_ptr<T, D> unique(m_block->data<T>(), std::move(deleter));
+        deleter.~D();
+        reset();
+        return unique;
+    }
+
     T* operator*()
     {
-        return m_data.operator*();
+        return *get();
     }
     const T* operator*() const
     {
-        return m_data.operator*();
+        return *get();
     }
     T* operator->()
     {
-        return m_data.operator->();
+        return get();
     }
     const T* operator->() const
     {
-        return m_data.operator->();
+        return get();
     }
     const T* get() const
     {
-        return m_data.get();
+        return m_block ? m_block->data<T>() : nullptr;
     }
     T* get()
     {
-        return m_data.get();
+        return m_block ? m_block->data<T>() : nullptr;
     }
     explicit operator bool() const
     {
-        return m_data.operator bool();
+        return get() != nullptr;
+    }
+
+private:
+    static constexpr bool poll_only = std::is_same<Policy, single_thread>::value;
+
+    static void schedule(strong_block* block, strong_decay_task task)
+    {
+        if (block) {
+            block->set_on_decay(std::move(task));
+        } else {
+            task();
+        }
+    }
+    template <typename Executor>
+    static void schedule(strong_block* block, strong_decay_task task, Executor executor)
+    {
+        schedule(block, strong_decay_task([task = std::move(task), executor = std::move(executor)]() mutable {
+            executor(std::move(task));
+        }));
+    }
+
+    strong_block* m_block{nullptr};
+};
+
+/**
+ * A strong_ptr to an array, as created by make_strong_array(). Next to the
+ * block it holds the length of the array, so that besides the whole array
+ * it can lend out slices of it, see get_shared(offset, length). Every slice
+ * holds off the decay of the whole array.
+ */
+template <typename T, typename Policy>
+class strong_ptr<T[], Policy> : private strong_ptr<T, Policy>
+{
+    using base = strong_ptr<T, Policy>;
+
+    template <typename U, typename P>
+    friend class strong_ptr;
+
+    template <typename U, typename P>
+    friend class decay_ptr;
+
+    template <typename U, typename Alloc>
+    friend strong_ptr<U[]> allocate_strong_array(const Alloc& alloc, std::size_t size);
+
+    strong_ptr(strong_block* block, std::size_t size) noexcept : base(block), m_size{size} {}
+
+public:
+    using element_type = T;
+    using loan_type = loan_slice<T, Policy>;
+
+    constexpr strong_ptr() = default;
+    constexpr strong_ptr(std::nullptr_t) : strong_ptr() {}
+    strong_ptr(strong_ptr&& rhs) noexcept : base(static_cast<base&&>(rhs)), m_size{std::exchange(rhs.m_size, 0)} {}
+
+    /** As with strong_ptr, an array may switch between the policies. */
+    template <typename P>
+    strong_ptr(strong_ptr<T[], P>&& rhs) : base(static_cast<strong_ptr<T, P>&&>(rhs)), m_size{std::exchange(rhs.m_size, 0)}
+    {
+    }
+
+    strong_ptr& operator=(strong_ptr&& rhs) noexcept
+    {
+        strong_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(strong_ptr& rhs) noexcept
+    {
+        base::swap(rhs);
+        std::swap(m_size, rhs.m_size);
+    }
+
+    void reset()
+    {
+        strong_ptr().swap(*this);
+    }
+
+    /** A loan of the whole array. */
+    loan_type get_shared() const
+    {
+        return get_shared(0, m_size);
+    }
+    /** A loan of elements offset to offset + length. */
+    loan_type get_shared(std::size_t offset, std::size_t length) const
+    {
+        assert(offset <= m_size && length <= m_size - offset);
+        if (!this->m_block) return loan_type();
+        T* data = this->m_block->template data<T>();
+        return loan_type(this->make_loan(Policy(), data), data + offset, length);
+    }
+
+    using base::enable_sharding;
+    using base::get;
+    using base::operator bool;
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    T& operator[](std::size_t i) const
+    {
+        assert(i < m_size);
+        return this->m_block->template data<T>()[i];
+    }
+
+private:
+    std::size_t m_size{0};
+};
+
+/** A decay_ptr for a strong_ptr<T[]>, keeping the length of the array. */
+template <typename T, typename Policy>
+class decay_ptr<T[], Policy> : private decay_ptr<T, Policy>
+{
+    using base = decay_ptr<T, Policy>;
+
+    template <typename U, typename P>
+    friend class decay_ptr;
+
+public:
+    using element_type = T;
+
+    constexpr decay_ptr() = default;
+    constexpr decay_ptr(std::nullptr_t) : decay_ptr() {}
+    decay_ptr(decay_ptr&& rhs) noexcept : base(static_cast<base&&>(rhs)), m_size{std::exchange(rhs.m_size, 0)} {}
+    decay_ptr(strong_ptr<T[], Policy>&& ptr) : base(static_cast<strong_ptr<T, Policy>&&>(ptr)), m_size{std::exchange(ptr.m_size, 0)} {}
+
+    decay_ptr& operator=(decay_ptr&& rhs) noexcept
+    {
+        decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    decay_ptr& operator=(strong_ptr<T[], Policy>&& rhs)
+    {
+        decay_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(decay_ptr& rhs) noexcept
+    {
+        base::swap(rhs);
+        std::swap(m_size, rhs.m_size);
+    }
+
+    void reset()
+    {
+        decay_ptr().swap(*this);
+    }
+
+    /** See decay_ptr::rearm(). */
+    strong_ptr<T[], Policy> rearm()
+    {
+        strong_ptr<T, Policy> ptr = base::rearm();
+        return strong_ptr<T[], Policy>(std::exchange(ptr.m_block, nullptr), std::exchange(m_size, 0));
+    }
+
+    using base::decayed;
+    using base::wait;
+    using base::wait_for;
+    using base::wait_until;
+    using base::on_decay;
+#if STRONG_PTR_COROUTINES
+    using base::decayed_async;
+    using base::decayed_async_until;
+    using base::decayed_async_for;
+#endif
+    using base::get;
+    using base::operator bool;
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+    T& operator[](std::size_t i) const
+    {
+        assert(i < m_size);
+        return this->m_block->template data<T>()[i];
     }
 
 private:
-    std::shared_ptr<T> m_data;
-    std::weak_ptr<void> m_decaying;
-    std::shared_ptr<wake_type> m_wake;
+    std::size_t m_size{0};
 };
 
+// Both are a single pointer to the block.
+static_assert(sizeof(strong_ptr<int>) == sizeof(void*), "strong_ptr should be one pointer wide");
+static_assert(sizeof(decay_ptr<int>) == sizeof(void*), "decay_ptr should be one pointer wide");
+
+/**
+ * Create a strong_ptr holding a T constructed from args, using alloc for
+ * memory. As with std::allocate_shared, the object and all of the
+ * bookkeeping for its loans share a single allocation.
+ */
+template <typename T, typename Alloc, typename... Args>
+inline strong_ptr<T> allocate_strong(const Alloc& alloc, Args&&... args)
+{
+    using block_type = strong_block_t<strong_inplace_block<T>, Alloc>;
+    block_type* block = nullptr;
+    std::shared_ptr<strong_anchor> owner = make_strong_block<block_type>(alloc, [&](void* mem, Alloc& a) {
+        return block = ::new (mem) block_type(a, std::forward<Args>(args)...);
+    });
+    return strong_ptr<T>(adopt_strong_block(std::move(owner), block->get()));
+}
+
 template <typename T, typename... Args>
 inline strong_ptr<T> make_strong(Args&&... args)
 {
-    return strong_ptr<T>(std::make_unique<T>(std::forward<Args>(args)...));
+    return allocate_strong<T>(std::allocator<T>(), std::forward<Args>(args)...);
+}
+
+/**
+ * Create a strong_ptr<T[]> holding size value-initialized Ts, using alloc
+ * for memory. The array takes an allocation of its own, next to the one for
+ * the bookkeeping.
+ */
+template <typename T, typename Alloc>
+inline strong_ptr<T[]> allocate_strong_array(const Alloc& alloc, std::size_t size)
+{
+    using block_type = strong_block_t<strong_array_block<T>, Alloc>;
+    block_type* block = nullptr;
+    std::shared_ptr<strong_anchor> owner = make_strong_block<block_type>(alloc, [&](void* mem, Alloc& a) {
+        return block = ::new (mem) block_type(a, size);
+    });
+    return strong_ptr<T[]>(adopt_strong_block(std::move(owner), block->m_ptr), size);
+}
+
+template <typename T>
+inline strong_ptr<T[]> make_strong_array(std::size_t size)
+{
+    return allocate_strong_array<T>(std::allocator<T>(), size);
 }
 
 
@@ -0,0 +1,146 @@
+// Copyright (c) 2017-2023 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRONGRECLAIMER_H
+#define BITCOIN_STRONGRECLAIMER_H
+
+#include "strong_ptr.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Destroys retired objects on a thread of its own, so that a destructor
+ * never runs on whichever thread happens to release the last loan.
+ *
+ * retire() turns a strong_ptr into a decay_ptr whose decay callback hands
+ * it to the reclaimer. Releasing the last loan then costs a short critical
+ * section to queue the pointer, and the reclaimer thread destroys all of
+ * the objects queued since it last woke up in one go.
+ *
+ * At most max_pending retired objects may be waiting to decay or to be
+ * destroyed at once; retire() blocks until there is room for more. The
+ * reclaimer can't be destroyed before its pending objects have decayed,
+ * so all of their loans must be released by then.
+ */
+class strong_reclaimer
+{
+public:
+    /**
+     * on_start, when set, runs first thing on the reclaimer thread, e.g. to
+     * lower its priority with the platform's scheduling API.
+     */
+    explicit strong_reclaimer(std::size_t max_pending = 4096, std::function<void()> on_start = nullptr) : m_max_pending{max_pending}
+    {
+        assert(max_pending > 0);
+        m_thread = std::thread([this, on_start = std::move(on_start)] {
+            if (on_start) on_start();
+            run();
+        });
+    }
+
+    strong_reclaimer(const strong_reclaimer&) = delete;
+    strong_reclaimer& operator=(const strong_reclaimer&) = delete;
+
+    /** Wait for all retired objects to decay and be destroyed. */
+    ~strong_reclaimer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_stopping = true;
+        }
+        m_work.notify_one();
+        m_thread.join();
+    }
+
+    /**
+     * Have the object destroyed on the reclaimer thread once it has
+     * decayed, leaving ptr null. Blocks while max_pending objects are
+     * pending, so the caller must not hold loans of any of them.
+     */
+    template <typename T>
+    void retire(strong_ptr<T>&& ptr)
+    {
+        if (!ptr) return;
+        {
+            std::unique_lock<std::mutex> lock(m_mut);
+            m_space.wait(lock, [this] { return m_pending < m_max_pending; });
+            ++m_pending;
+        }
+        ptr.retire([](decay_ptr<T>) {}, executor{this});
+    }
+
+    /** Retired objects that have not been destroyed yet. */
+    std::size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(m_mut);
+        return m_pending;
+    }
+
+    std::size_t max_pending() const
+    {
+        return m_max_pending;
+    }
+
+private:
+    // Queues the retire callback, which owns the decay_ptr, for the thread.
+    struct executor {
+        void operator()(strong_decay_task task) const
+        {
+            bool wake;
+            {
+                std::lock_guard<std::mutex> lock(m_reclaimer->m_mut);
+                m_reclaimer->m_decayed.push_back(std::move(task));
+                wake = m_reclaimer->m_idle;
+                m_reclaimer->m_idle = false;
+            }
+            if (wake) m_reclaimer->m_work.notify_one();
+        }
+        strong_reclaimer* m_reclaimer;
+    };
+
+    void run()
+    {
+        std::vector<strong_decay_task> batch;
+        std::unique_lock<std::mutex> lock(m_mut);
+        while (true) {
+            if (m_decayed.empty()) {
+                if (m_stopping && m_pending == 0) break;
+                m_idle = true;
+                m_work.wait(lock, [this] { return !m_decayed.empty() || (m_stopping && m_pending == 0); });
+                m_idle = false;
+                continue;
+            }
+            batch.swap(m_decayed);
+            lock.unlock();
+            const std::size_t count = batch.size();
+            for (strong_decay_task& task : batch) {
+                task();
+            }
+            // Destroying the tasks destroys their decay_ptrs, and the objects.
+            batch.clear();
+            lock.lock();
+            m_pending -= count;
+            m_space.notify_all();
+        }
+    }
+
+    const std::size_t m_max_pending;
+    mutable std::mutex m_mut;
+    std::condition_variable m_work;
+    std::condition_variable m_space;
+    std::vector<strong_decay_task> m_decayed;
+    std::size_t m_pending{0};
+    bool m_idle{false};
+    bool m_stopping{false};
+    std::thread m_thread;
+};
+
+#endif // BITCOIN_STRONGRECLAIMER_H
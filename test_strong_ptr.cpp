@@ -3,7 +3,41 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "strong_ptr.h"
+#include "intrusive_strong_ptr.h"
+#include "ipc_strong_ptr.h"
+#include "atomic_strong_cell.h"
+#include "decay_fd.h"
+#include "decay_set.h"
+#include "strong_pool.h"
+#include "strong_reclaimer.h"
+#include "numa_strong_ptr.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if __cplusplus >= 201703L
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define HAVE_MEMORY_RESOURCE 1
+#endif
+#endif
 
 class my_struct
 {
@@ -41,6 +75,43 @@ private:
     bool& m_deleted;
 };
 
+template <typename T>
+class counting_allocator
+{
+public:
+    using value_type = T;
+
+    explicit counting_allocator(int& allocs) : m_allocs{allocs} {}
+    // total counts every allocation, including those freed since.
+    counting_allocator(int& allocs, int& total) : m_allocs{allocs}, m_total{&total} {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>& rhs) : m_allocs{rhs.m_allocs}, m_total{rhs.m_total} {}
+
+    T* allocate(std::size_t n)
+    {
+        ++m_allocs;
+        if (m_total) ++*m_total;
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* ptr, std::size_t n)
+    {
+        --m_allocs;
+        std::allocator<T>().deallocate(ptr, n);
+    }
+    template <typename U>
+    bool operator==(const counting_allocator<U>& rhs) const
+    {
+        return &m_allocs == &rhs.m_allocs;
+    }
+    template <typename U>
+    bool operator!=(const counting_allocator<U>& rhs) const
+    {
+        return !(*this == rhs);
+    }
+
+    int& m_allocs;
+    int* m_total{nullptr};
+};
 
 static void test_construction()
 {
@@ -55,6 +126,180 @@ static void test_construction()
     assert(degraded->valid());
 }
 
+static void test_make_strong()
+{
+    // the object and its bookkeeping share one allocation
+    {
+        int allocs = 0;
+        strong_ptr<my_struct> strong = allocate_strong<my_struct>(counting_allocator<my_struct>(allocs), 1);
+        assert(allocs == 1);
+        assert(strong->valid());
+        auto shared = strong.get_shared();
+        assert(allocs == 1);
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(!degraded.decayed());
+        shared.reset();
+        assert(degraded.decayed());
+        assert(degraded->valid());
+        assert(allocs == 1);
+        degraded.reset();
+        assert(allocs == 0);
+    }
+    // a loan outliving the strong_ptr keeps the allocation alive
+    {
+        int allocs = 0;
+        std::shared_ptr<my_struct> shared;
+        {
+            strong_ptr<my_struct> strong = allocate_strong<my_struct>(counting_allocator<my_struct>(allocs));
+            shared = strong.get_shared();
+        }
+        assert(allocs == 1);
+        assert(shared->valid());
+        shared.reset();
+        assert(allocs == 0);
+    }
+    {
+        strong_ptr<int> strong = make_strong<int>(5);
+        assert(*strong.get() == 5);
+        decay_ptr<int> degraded(std::move(strong));
+        assert(degraded.decayed());
+        assert(*degraded.get() == 5);
+    }
+}
+
+static void test_allocator()
+{
+    // the bookkeeping and the wake state come from the allocator
+    {
+        int allocs = 0;
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted), counting_allocator<char>(allocs));
+        assert(allocs == 1);
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        assert(allocs == 2);
+        shared.reset();
+        degraded.wait();
+        assert(!deleted);
+        degraded.reset();
+        assert(deleted);
+        assert(allocs == 0);
+    }
+    {
+        int allocs = 0;
+        bool deleted = false;
+        strong_ptr<my_struct> strong;
+        strong.reset(new my_struct(), Deleter(deleted), counting_allocator<char>(allocs));
+        assert(allocs == 1);
+        strong.reset();
+        assert(deleted);
+        assert(allocs == 0);
+    }
+#ifdef HAVE_MEMORY_RESOURCE
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        std::pmr::polymorphic_allocator<char> alloc(&arena);
+        auto strong = allocate_strong<std::pmr::vector<int>>(alloc, 3, 1);
+        // uses-allocator construction reaches the object too
+        assert(strong->get_allocator().resource() == &arena);
+        auto shared = strong.get_shared();
+        decay_ptr<std::pmr::vector<int>> degraded(std::move(strong));
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        shared.reset();
+        degraded.wait();
+        assert(degraded->size() == 3);
+    }
+#endif
+}
+
+#if STRONG_PTR_BLOCK_CACHE
+static void test_block_cache()
+{
+    // freed blocks are handed out again
+    {
+        void* mem = strong_block_cache::allocate(100);
+        strong_block_cache::deallocate(mem, 100);
+        assert(strong_block_cache::allocate(128) == mem);
+        strong_block_cache::deallocate(mem, 128);
+    }
+    // including ones freed by another thread, once it gave them up
+    {
+        std::vector<void*> mems;
+        for (std::size_t i = 0; i < strong_block_cache::local_limit; ++i) {
+            mems.push_back(strong_block_cache::allocate(strong_block_cache::max_size));
+        }
+        std::thread thr([&] {
+            for (void* mem : mems) strong_block_cache::deallocate(mem, strong_block_cache::max_size);
+        });
+        thr.join();
+        void* mem = strong_block_cache::allocate(strong_block_cache::max_size);
+        assert(std::find(mems.begin(), mems.end(), mem) != mems.end());
+        strong_block_cache::deallocate(mem, strong_block_cache::max_size);
+    }
+    // churn through reset() across threads
+    {
+        strong_ptr<my_struct> strong;
+        for (int i = 0; i < 1000; ++i) {
+            strong.reset(new my_struct());
+            std::thread thr([](std::shared_ptr<my_struct> shared) { assert(shared->valid()); }, strong.get_shared());
+            decay_ptr<my_struct> degraded(std::move(strong));
+            degraded.wait_for(std::chrono::hours(1));
+            thr.join();
+        }
+    }
+}
+#endif
+
+static void test_lazy_wake()
+{
+    // there is no wake state to wait on once decayed
+    {
+        decay_ptr<my_struct> degraded(strong_ptr<my_struct>(nullptr));
+        assert(degraded.decayed());
+        degraded.wait();
+        assert(degraded.wait_for(std::chrono::seconds(0)) == std::cv_status::no_timeout);
+    }
+    {
+        decay_ptr<my_struct> degraded(make_strong<my_struct>());
+        assert(degraded.decayed());
+        degraded.wait();
+        assert(degraded.wait_until(std::chrono::steady_clock::now()) == std::cv_status::no_timeout);
+    }
+    // the wake state created by a waiter is handed to the last loan
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(!degraded.wait_for(std::chrono::milliseconds(1), [&] { return degraded.decayed(); }));
+        shared.reset();
+        assert(degraded.wait_for(std::chrono::milliseconds(1), [&] { return degraded.decayed(); }));
+        degraded.wait();
+    }
+    // decaying ends a wait whose predicate never comes true
+    for (int kind = 0; kind < 3; ++kind) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        std::thread thread([&shared] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            shared.reset();
+        });
+        const auto never = [] { return false; };
+        const auto start = std::chrono::steady_clock::now();
+        if (kind == 0) {
+            degraded.wait(never);
+        } else if (kind == 1) {
+            assert(!degraded.wait_for(std::chrono::seconds(10), never));
+        } else {
+            assert(!degraded.wait_until(start + std::chrono::seconds(10), never));
+        }
+        assert(degraded.decayed());
+        assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(10));
+        thread.join();
+    }
+}
+
 static void test_deletion()
 {
     // test typical deletion
@@ -129,15 +374,1602 @@ static void test_use_count()
         assert(degraded.decayed());
 }
 
-static void test_wait()
+static void test_borrow()
+{
+    {
+        strong_ptr<int> strong = make_strong<int>(5);
+        auto borrowed = strong.borrow();
+        assert(borrowed && *borrowed == 5);
+        assert(borrowed.get() == strong.get());
+        assert(strong.get_shared().use_count() == 2);
+    }
+    {
+        strong_ptr<int> strong;
+        auto borrowed = strong.borrow();
+        assert(!borrowed);
+        assert(!borrowed.to_shared());
+    }
+    // a borrow holds off decay until it ends
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        decay_ptr<my_struct> degraded;
+        {
+            auto borrowed = strong.borrow();
+            auto moved = std::move(borrowed);
+            degraded = std::move(strong);
+            assert(!degraded.decayed());
+        }
+        assert(degraded.decayed());
+    }
+    // the object outlives its strong_ptr while borrowed
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        std::shared_ptr<my_struct> shared;
+        {
+            auto borrowed = strong.borrow();
+            auto nested = strong.borrow();
+            strong.reset();
+            assert(!deleted);
+            shared = borrowed.to_shared();
+        }
+        assert(!deleted);
+        shared.reset();
+        assert(deleted);
+    }
+}
+
+static void test_loan_batch()
+{
+    {
+        strong_ptr<int> strong = make_strong<int>(5);
+        auto batch = strong.get_shared_n(3);
+        assert(batch.size() == 3 && *batch == 5);
+        assert(!strong.get_shared_n(0));
+        assert(!strong_ptr<int>().get_shared_n(2));
+    }
+    // the batch holds off decay until its last loan is returned
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        auto batch = strong.get_shared_n(4);
+        auto one = batch.split();
+        auto two = batch.split(2);
+        assert(batch.size() == 1 && one.size() == 1 && two.size() == 2);
+        decay_ptr<my_struct> degraded(std::move(strong));
+        two.merge(std::move(one));
+        assert(!one && two.size() == 3);
+        batch.reset();
+        assert(!degraded.decayed());
+        auto last = two.split(3);
+        assert(!two);
+        last.reset();
+        assert(degraded.decayed());
+        assert(!deleted);
+    }
+    // the object outlives its strong_ptr as long as a batch does
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        auto first = strong.get_shared_n(1);
+        auto shared = strong.get_shared();
+        auto borrowed = strong.borrow();
+        strong.reset();
+        shared.reset();
+        assert(!deleted);
+        first.reset();
+        assert(!deleted);
+        {
+            auto gone = std::move(borrowed);
+        }
+        assert(deleted);
+    }
+    // batches released on many threads decay the pointer exactly once
+    for (int i = 0; i < 20; ++i) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto batch = strong.get_shared_n(8);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([](loan_batch<my_struct> loans) {
+                auto more = loans.split();
+                std::this_thread::yield();
+            }, batch.split(2));
+        }
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait();
+        for (auto& thread : threads) thread.join();
+    }
+}
+
+static void test_single_thread()
+{
+    {
+        strong_ptr<int, single_thread> strong = make_strong<int>(5);
+        local_loan<int> shared = strong.get_shared();
+        assert(shared && *shared == 5);
+        local_loan<int> copy = shared;
+        shared.reset();
+        decay_ptr<int, single_thread> degraded(std::move(strong));
+        assert(!degraded.decayed());
+        assert(!degraded.wait_for(std::chrono::seconds(10), [&] { return degraded.decayed(); }));
+        assert(degraded.wait_until(std::chrono::steady_clock::now() + std::chrono::seconds(10)) == std::cv_status::timeout);
+        copy = nullptr;
+        assert(degraded.decayed());
+        degraded.wait();
+        assert(degraded.wait_for(std::chrono::seconds(0)) == std::cv_status::no_timeout);
+    }
+    // local loans keep the object alive, and can be turned into regular ones
+    {
+        bool deleted = false;
+        strong_ptr<my_struct, single_thread> strong(new my_struct(), Deleter(deleted));
+        auto shared = strong.get_shared();
+        strong.reset();
+        assert(!deleted);
+        std::shared_ptr<my_struct> escaped = shared.to_shared();
+        shared.reset();
+        assert(!deleted);
+        std::thread([](std::shared_ptr<my_struct> loan) { loan.reset(); }, std::move(escaped)).join();
+        assert(deleted);
+    }
+}
+
+struct hooked : strong_ptr_hook
+{
+    explicit hooked(bool& deleted, int value = 0) : m_deleted{&deleted}, m_value{value} {}
+    ~hooked()
+    {
+        *m_deleted = true;
+    }
+    bool* m_deleted;
+    int m_value;
+};
+
+static void test_intrusive()
+{
+    {
+        bool deleted = false;
+        {
+            intrusive_strong_ptr<hooked> strong = make_intrusive_strong<hooked>(deleted, 5);
+            assert(strong && strong->m_value == 5);
+            intrusive_loan<strong_ptr_hook> base = strong.get_shared();
+            assert(base.get() == strong.get());
+        }
+        assert(deleted);
+    }
+    // loans hold off decay, and the object outlives the decay_ptr while loaned
+    {
+        bool deleted = false;
+        intrusive_strong_ptr<hooked> strong(new hooked(deleted));
+        auto shared = strong.get_shared();
+        auto copy = shared;
+        intrusive_decay_ptr<hooked> degraded(std::move(strong));
+        assert(!strong && degraded.get() == shared.get());
+        shared.reset();
+        assert(!degraded.decayed());
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        degraded.reset();
+        assert(!deleted);
+        copy.reset();
+        assert(deleted);
+    }
+    {
+        intrusive_decay_ptr<hooked> degraded;
+        assert(degraded.decayed());
+        degraded.wait();
+        assert(degraded.wait_until(std::chrono::steady_clock::now()) == std::cv_status::no_timeout);
+    }
+    // copies of a hooked object start out unowned
+    {
+        bool deleted = false;
+        bool copy_deleted = false;
+        intrusive_strong_ptr<hooked> strong = make_intrusive_strong<hooked>(deleted, 1);
+        auto shared = strong.get_shared();
+        intrusive_strong_ptr<hooked> copy(new hooked(*strong));
+        assert(copy->m_value == 1);
+        copy->m_deleted = &copy_deleted;
+        copy.reset();
+        assert(copy_deleted && !deleted);
+    }
+    // waiting for a loan released by another thread
+    for (int i = 0; i < 20; ++i) {
+        bool deleted = false;
+        intrusive_strong_ptr<hooked> strong = make_intrusive_strong<hooked>(deleted);
+        std::thread thread([](intrusive_loan<hooked> loan) {
+            std::this_thread::yield();
+            loan.reset();
+        }, strong.get_shared());
+        intrusive_decay_ptr<hooked> degraded(std::move(strong));
+        if (i % 2) {
+            degraded.wait();
+        } else {
+            assert(degraded.wait_for(std::chrono::seconds(10), [&] { return degraded.decayed(); }));
+        }
+        assert(degraded.decayed() && !deleted);
+        thread.join();
+        degraded.reset();
+        assert(deleted);
+    }
+}
+
+static void test_rearm()
+{
+    {
+        decay_ptr<int> degraded;
+        assert(!degraded.rearm());
+    }
+    // the same object is loaned out again, and decays again
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        my_struct* const object = strong.get();
+        for (int i = 0; i < 3; ++i) {
+            auto shared = strong.get_shared();
+            decay_ptr<my_struct> degraded(std::move(strong));
+            assert(!degraded.decayed());
+            assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+            shared.reset();
+            assert(degraded.decayed());
+            strong = degraded.rearm();
+            assert(!degraded && strong.get() == object);
+            assert(strong.get_shared().use_count() == 2);
+        }
+        assert(!deleted);
+        strong.reset();
+        assert(deleted);
+    }
+    // a rearmed object outlives its owner and decay_ptr while loaned
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        strong = decay_ptr<my_struct>(std::move(strong)).rearm();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.reset();
+        assert(!deleted && shared->valid());
+        shared.reset();
+        assert(deleted);
+    }
+    {
+        int allocs = 0;
+        {
+            strong_ptr<my_struct> strong = allocate_strong<my_struct>(counting_allocator<my_struct>(allocs));
+            strong = decay_ptr<my_struct>(std::move(strong)).rearm();
+            assert(allocs == 2);
+        }
+        assert(allocs == 0);
+    }
+    // the control block of the previous rearm is reused
+    {
+        int allocs = 0;
+        int total = 0;
+        {
+            strong_ptr<my_struct> strong = allocate_strong<my_struct>(counting_allocator<my_struct>(allocs, total));
+            for (int i = 0; i < 10; ++i) {
+                auto shared = strong.get_shared();
+                decay_ptr<my_struct> degraded(std::move(strong));
+                shared.reset();
+                strong = degraded.rearm();
+                assert(strong->valid());
+            }
+            // the block, and a single control block for all of the rearms
+            assert(total == 2);
+        }
+        assert(allocs == 0);
+    }
+    // recycling with loans released on other threads
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        for (int i = 0; i < 50; ++i) {
+            std::thread thread([](std::shared_ptr<my_struct> loan) {
+                std::this_thread::yield();
+                loan.reset();
+            }, strong.get_shared());
+            decay_ptr<my_struct> degraded(std::move(strong));
+            degraded.wait();
+            strong = degraded.rearm();
+            thread.join();
+        }
+    }
+}
+
+static void test_pool()
+{
+    // slots are reused once an object has decayed and been released
+    {
+        strong_pool<my_struct> pool(4, 2);
+        strong_ptr<my_struct> strong = pool.make();
+        my_struct* const object = strong.get();
+        assert(pool.capacity() == 4);
+        for (int i = 0; i < 10; ++i) {
+            auto shared = strong.get_shared();
+            decay_ptr<my_struct> degraded(std::move(strong));
+            shared.reset();
+            assert(degraded.decayed());
+            degraded.reset();
+            strong = pool.make();
+            assert(strong.get() == object && strong->valid());
+        }
+        assert(pool.capacity() == 4);
+    }
+    // the pool grows by a slab at a time, then falls back to the heap
+    {
+        strong_pool<int> pool(2, 2);
+        std::vector<strong_ptr<int>> pointers;
+        for (int i = 0; i < 6; ++i) {
+            pointers.push_back(pool.make(i));
+            assert(pool.capacity() == std::min<std::size_t>(4, (i / 2 + 1) * 2));
+        }
+        for (int i = 0; i < 6; ++i) {
+            assert(*pointers[i].get() == i);
+        }
+        pointers.clear();
+        pointers.push_back(pool.make(1));
+        assert(pool.capacity() == 4);
+    }
+    // objects made and released concurrently stay within the pool
+    {
+        strong_pool<my_struct> pool(64, 1);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&pool] {
+                for (int i = 0; i < 1000; ++i) {
+                    strong_ptr<my_struct> strong = pool.make();
+                    auto shared = strong.get_shared();
+                    decay_ptr<my_struct> degraded(std::move(strong));
+                    assert(shared->valid());
+                    shared.reset();
+                    degraded.wait();
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        assert(pool.capacity() == 64);
+    }
+    // slots cached by a thread go back to the pool when it exits
+    {
+        strong_pool<int> pool(2, 1);
+        std::vector<int*> objects;
+        std::thread thread([&] {
+            strong_ptr<int> first = pool.make(1);
+            strong_ptr<int> second = pool.make(2);
+            objects = {first.get(), second.get()};
+        });
+        thread.join();
+        strong_ptr<int> first = pool.make(3);
+        strong_ptr<int> second = pool.make(4);
+        assert(std::find(objects.begin(), objects.end(), first.get()) != objects.end());
+        assert(std::find(objects.begin(), objects.end(), second.get()) != objects.end());
+        assert(pool.capacity() == 2);
+    }
+    // or are dropped, if the pool is gone by then
+    {
+        std::mutex mut;
+        std::condition_variable cond;
+        bool pool_gone = false;
+        std::unique_ptr<strong_pool<int>> pool(new strong_pool<int>(4, 1));
+        std::thread thread([&] {
+            pool->make(1).reset();
+            std::unique_lock<std::mutex> lock(mut);
+            cond.wait(lock, [&] { return pool_gone; });
+        });
+        while (pool->capacity() == 0) std::this_thread::yield();
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            pool.reset();
+            pool_gone = true;
+        }
+        cond.notify_one();
+        thread.join();
+    }
+    // a pool with many slabs finds each slot's slab without searching
+    {
+        strong_pool<int> pool(1, 200);
+        std::vector<strong_ptr<int>> pointers;
+        for (int i = 0; i < 250; ++i) {
+            pointers.push_back(pool.make(i));
+        }
+        assert(pool.capacity() == 200);
+        std::vector<int*> objects;
+        for (auto& pointer : pointers) {
+            objects.push_back(pointer.get());
+        }
+        pointers.clear();
+        for (int i = 0; i < 200; ++i) {
+            pointers.push_back(pool.make(i));
+        }
+        for (int i = 0; i < 200; ++i) {
+            assert(std::find(objects.begin(), objects.begin() + 200, pointers[i].get()) != objects.begin() + 200);
+        }
+        assert(pool.capacity() == 200);
+    }
+}
+
+/** Records the thread it was destroyed on. */
+struct reclaimed
 {
-    //TODO
+    explicit reclaimed(std::atomic<std::thread::id>& destroyed_on) : m_destroyed_on{destroyed_on} {}
+    ~reclaimed()
+    {
+        m_destroyed_on = std::this_thread::get_id();
+    }
+    std::atomic<std::thread::id>& m_destroyed_on;
+};
+
+static void test_on_decay()
+{
+    // run by the last loan, or right away once decayed
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        bool called = false;
+        degraded.on_decay([&] {
+            assert(degraded.decayed() && degraded->valid());
+            called = true;
+        });
+        assert(!called);
+        shared.reset();
+        assert(called);
+        called = false;
+        degraded.on_decay([&] { called = true; });
+        assert(called);
+    }
+    {
+        bool called = false;
+        decay_ptr<my_struct>().on_decay([&] { called = true; });
+        assert(called);
+    }
+    // an executor decides where the callback runs
+    {
+        std::vector<strong_decay_task> tasks;
+        auto executor = [&](strong_decay_task task) { tasks.push_back(std::move(task)); };
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        bool called = false;
+        degraded.on_decay([&] { called = true; }, executor);
+        shared.reset();
+        assert(!called && tasks.size() == 1);
+        tasks.back()();
+        assert(called);
+    }
+    // retiring hands over the decay_ptr, and the object goes with it
+    {
+        bool deleted = false;
+        bool called = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        auto shared = strong.get_shared();
+        strong.retire([&](decay_ptr<my_struct> degraded) {
+            assert(degraded.decayed() && !deleted);
+            called = true;
+        });
+        assert(!strong && !called);
+        shared.reset();
+        assert(called && deleted);
+    }
+    {
+        std::vector<strong_decay_task> tasks;
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        decay_ptr<my_struct> kept;
+        strong.retire([&](decay_ptr<my_struct> degraded) { kept = std::move(degraded); }, [&](strong_decay_task task) { tasks.push_back(std::move(task)); });
+        assert(tasks.size() == 1 && !deleted);
+        tasks.back()();
+        tasks.clear();
+        assert(kept && !deleted);
+        strong = kept.rearm();
+        assert(strong->valid());
+    }
+    // with an executor, the object is destroyed wherever that runs the task,
+    // however late the releasing thread is done with the loan's control block
+    {
+        std::mutex mut;
+        std::condition_variable cond;
+        std::vector<strong_decay_task> queue;
+        bool done = false;
+        std::thread::id executor_thread;
+        std::thread worker([&] {
+            std::unique_lock<std::mutex> lock(mut);
+            executor_thread = std::this_thread::get_id();
+            while (true) {
+                cond.wait(lock, [&] { return done || !queue.empty(); });
+                if (queue.empty()) break;
+                std::vector<strong_decay_task> tasks;
+                tasks.swap(queue);
+                lock.unlock();
+                for (auto& task : tasks) task();
+                tasks.clear();
+                lock.lock();
+            }
+        });
+        auto executor = [&](strong_decay_task task) {
+            {
+                std::lock_guard<std::mutex> lock(mut);
+                queue.push_back(std::move(task));
+            }
+            cond.notify_one();
+        };
+        for (int i = 0; i < 2000; ++i) {
+            std::atomic<std::thread::id> destroyed_on{};
+            strong_ptr<reclaimed> strong = make_strong<reclaimed>(destroyed_on);
+            auto shared = strong.get_shared();
+            strong.retire([](decay_ptr<reclaimed>) {}, executor);
+            shared.reset();
+            while (destroyed_on.load() == std::thread::id()) std::this_thread::yield();
+            std::lock_guard<std::mutex> lock(mut);
+            assert(destroyed_on.load() == executor_thread);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            done = true;
+        }
+        cond.notify_one();
+        worker.join();
+    }
+    // callbacks race with the release of loans on other threads
+    for (int i = 0; i < 100; ++i) {
+        std::atomic<int> calls{0};
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::thread thread([](std::shared_ptr<my_struct> loan) { loan.reset(); }, strong.get_shared());
+        strong.retire([&](decay_ptr<my_struct>) { ++calls; });
+        thread.join();
+        assert(calls == 1);
+    }
+}
+
+#if STRONG_PTR_COROUTINES
+/** A coroutine that starts right away and cleans up after itself. */
+struct detached_coroutine
+{
+    struct promise_type {
+        detached_coroutine get_return_object()
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+static detached_coroutine await_decay(decay_ptr<my_struct>& degraded, bool& resumed)
+{
+    co_await degraded.decayed_async();
+    assert(degraded.decayed());
+    resumed = true;
+}
+
+template <typename Executor>
+static detached_coroutine await_decay(decay_ptr<my_struct>& degraded, Executor executor, bool& resumed)
+{
+    co_await degraded.decayed_async(std::move(executor));
+    resumed = true;
+}
+
+template <typename Timer>
+static detached_coroutine await_decay_for(decay_ptr<my_struct>& degraded, Timer timer, std::cv_status& status, bool& resumed)
+{
+    status = co_await degraded.decayed_async_for(std::chrono::seconds(1), std::move(timer));
+    resumed = true;
+}
+
+template <typename Timer>
+static detached_coroutine retry_decay_for(decay_ptr<my_struct>& degraded, Timer timer, int& timeouts, bool& resumed)
+{
+    // Not co_await in the loop condition, which GCC 12 miscompiles.
+    while (true) {
+        const std::cv_status status = co_await degraded.decayed_async_for(std::chrono::seconds(1), timer);
+        if (status == std::cv_status::no_timeout) break;
+        ++timeouts;
+    }
+    resumed = true;
+}
+
+static void test_coroutine()
+{
+    // resumed by the last loan, or not suspended at all once decayed
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        bool resumed = false;
+        await_decay(degraded, resumed);
+        assert(!resumed);
+        shared.reset();
+        assert(resumed);
+        resumed = false;
+        await_decay(degraded, resumed);
+        assert(resumed);
+    }
+    {
+        decay_ptr<my_struct> degraded;
+        bool resumed = false;
+        await_decay(degraded, resumed);
+        assert(resumed);
+    }
+    // an executor decides where the coroutine is resumed
+    {
+        std::vector<strong_decay_task> tasks;
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        bool resumed = false;
+        await_decay(degraded, [&](strong_decay_task task) { tasks.push_back(std::move(task)); }, resumed);
+        shared.reset();
+        assert(!resumed && tasks.size() == 1);
+        tasks.back()();
+        assert(resumed);
+    }
+    // the timed wait resumes once, with whichever of decay and timeout is first
+    for (bool timeout : {false, true}) {
+        std::vector<strong_decay_task> timers;
+        auto timer = [&](std::chrono::steady_clock::time_point, strong_decay_task task) { timers.push_back(std::move(task)); };
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        std::cv_status status{};
+        bool resumed = false;
+        await_decay_for(degraded, timer, status, resumed);
+        assert(!resumed && timers.size() == 1);
+        if (timeout) {
+            timers.back()();
+            assert(resumed && status == std::cv_status::timeout);
+            resumed = false;
+            shared.reset();
+        } else {
+            shared.reset();
+            assert(resumed && status == std::cv_status::no_timeout);
+            resumed = false;
+            timers.back()();
+        }
+        assert(!resumed);
+    }
+    // a timed out wait can be retried, or give way to another callback
+    {
+        std::vector<strong_decay_task> timers;
+        auto timer = [&](std::chrono::steady_clock::time_point, strong_decay_task task) { timers.push_back(std::move(task)); };
+        auto fire = [&] {
+            strong_decay_task task = std::move(timers.back());
+            timers.pop_back();
+            task();
+        };
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        int timeouts = 0;
+        bool resumed = false;
+        retry_decay_for(degraded, timer, timeouts, resumed);
+        for (int i = 0; i < 3; ++i) {
+            fire();
+        }
+        assert(!resumed && timeouts == 3 && timers.size() == 1);
+        shared.reset();
+        assert(resumed && timeouts == 3);
+        fire();
+
+        strong = make_strong<my_struct>();
+        shared = strong.get_shared();
+        degraded = std::move(strong);
+        std::cv_status status{};
+        resumed = false;
+        await_decay_for(degraded, timer, status, resumed);
+        fire();
+        assert(resumed && status == std::cv_status::timeout);
+        bool called = false;
+        degraded.on_decay([&] { called = true; });
+        shared.reset();
+        assert(called);
+    }
+    // a timeout racing the decay resumes exactly once
+    for (int i = 0; i < 1000; ++i) {
+        strong_decay_task fired;
+        auto timer = [&](std::chrono::steady_clock::time_point, strong_decay_task task) { fired = std::move(task); };
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        std::atomic<int> resumes{0};
+        [](decay_ptr<my_struct>& degraded, decltype(timer) timer, std::atomic<int>& resumes) -> detached_coroutine {
+            co_await degraded.decayed_async_for(std::chrono::seconds(1), std::move(timer));
+            ++resumes;
+        }(degraded, timer, resumes);
+        std::thread thread([&fired] { fired(); });
+        shared.reset();
+        thread.join();
+        assert(resumes == 1 && degraded.decayed());
+    }
+    // resumed on the thread releasing the last loan
+    for (int i = 0; i < 100; ++i) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::thread thread([](std::shared_ptr<my_struct> loan) { loan.reset(); }, strong.get_shared());
+        decay_ptr<my_struct> degraded(std::move(strong));
+        std::atomic<bool> resumed{false};
+        [](decay_ptr<my_struct>& degraded, std::atomic<bool>& resumed) -> detached_coroutine {
+            co_await degraded.decayed_async();
+            resumed = true;
+        }(degraded, resumed);
+        thread.join();
+        assert(resumed);
+    }
+}
+#endif
+
+struct session
+{
+    int m_id{7};
+    std::vector<int> m_table{1, 2, 3};
+    const std::vector<int>& table() const
+    {
+        return m_table;
+    }
+};
+
+struct counting_delete
+{
+    void operator()(my_struct* ptr) const
+    {
+        ++*m_count;
+        delete ptr;
+    }
+    int* m_count;
+};
+
+static void test_release_unique()
+{
+    {
+        my_struct* raw = new my_struct();
+        strong_ptr<my_struct> strong(raw);
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        // not before decaying
+        assert(!degraded.release_unique() && degraded.get() == raw);
+        shared.reset();
+        std::unique_ptr<my_struct> unique = degraded.release_unique();
+        assert(unique.get() == raw && unique->valid() && !degraded);
+    }
+    {
+        int deletes = 0;
+        std::unique_ptr<my_struct, counting_delete> original(new my_struct(), counting_delete{&deletes});
+        decay_ptr<my_struct> degraded(strong_ptr<my_struct>(std::move(original)));
+        // the deleter has to match
+        assert(!degraded.release_unique() && degraded);
+        std::unique_ptr<my_struct, counting_delete> unique = degraded.release_unique<counting_delete>();
+        assert(unique && !degraded && deletes == 0);
+        unique.reset();
+        assert(deletes == 1);
+    }
+    {
+        // the object shares its allocation with the bookkeeping
+        decay_ptr<my_struct> degraded(make_strong<my_struct>());
+        assert(!degraded.release_unique() && degraded->valid());
+        assert(!decay_ptr<my_struct>().release_unique());
+    }
+    {
+        int allocs = 0;
+        my_struct* raw = new my_struct();
+        decay_ptr<my_struct> degraded(strong_ptr<my_struct>(raw, std::default_delete<my_struct>(), counting_allocator<my_struct>(allocs)));
+        assert(allocs == 1);
+        std::unique_ptr<my_struct> unique = degraded.release_unique();
+        assert(unique.get() == raw && allocs == 0);
+    }
+}
+
+static void test_weak()
+{
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        weak_loan<my_struct> weak = strong.get_weak();
+        weak_loan<my_struct> copy = weak;
+        assert(!weak.expired());
+        std::shared_ptr<my_struct> shared = weak.lock();
+        assert(shared.get() == strong.get());
+        // weak loans don't hold off decay, and fail once it has started
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(weak.expired() && !copy.lock());
+        assert(!degraded.decayed());
+        shared.reset();
+        assert(degraded.decayed());
+        strong = degraded.rearm();
+        assert(!weak.lock() && strong.get_weak().lock());
+    }
+    {
+        bool deleted = false;
+        weak_loan<my_struct> weak;
+        {
+            strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+            weak = strong.get_weak();
+            assert(weak.lock()->valid());
+        }
+        assert(deleted && weak.expired() && !weak.lock());
+    }
+    {
+        assert(weak_loan<my_struct>().expired() && !strong_ptr<my_struct>().get_weak().lock());
+        strong_ptr<my_struct, single_thread> local = make_strong<my_struct>();
+        weak_loan<my_struct> weak = local.get_weak();
+        std::shared_ptr<my_struct> shared = weak.lock();
+        decay_ptr<my_struct, single_thread> degraded(std::move(local));
+        assert(!weak.lock() && !degraded.decayed());
+        shared.reset();
+        assert(degraded.decayed());
+    }
+    // upgrades race with the owner letting go
+    for (int i = 0; i < 100; ++i) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::vector<weak_loan<my_struct>> weaks(2, strong.get_weak());
+        std::atomic<bool> go{false};
+        std::vector<std::thread> threads;
+        for (auto& weak : weaks) {
+            threads.emplace_back([&go, &weak] {
+                while (!go) std::this_thread::yield();
+                while (std::shared_ptr<my_struct> shared = weak.lock()) {
+                    assert(shared->valid());
+                }
+            });
+        }
+        go = true;
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait();
+        assert(!weaks[0].lock());
+        for (auto& thread : threads) thread.join();
+    }
+}
+
+static void test_projection()
+{
+    {
+        strong_ptr<session> strong = make_strong<session>();
+        std::shared_ptr<std::vector<int>> table = strong.get_shared(&session::m_table);
+        assert(table.get() == &strong.get()->m_table && table->size() == 3);
+        std::shared_ptr<const std::vector<int>> viewed = strong.get_shared([](session& s) -> const std::vector<int>& { return s.table(); });
+        assert(viewed.get() == table.get());
+        std::shared_ptr<int> id = strong.get_shared([](session& s) -> int& { return s.m_id; });
+        assert(*id == 7);
+        decay_ptr<session> degraded(std::move(strong));
+        table.reset();
+        viewed.reset();
+        assert(!degraded.decayed() && *id == 7);
+        id.reset();
+        assert(degraded.decayed());
+    }
+    {
+        strong_ptr<session> null;
+        assert(!null.get_shared(&session::m_id));
+        assert(!null.get_shared([](session& s) -> int& { return s.m_id; }));
+    }
+    {
+        strong_ptr<session, single_thread> local = make_strong<session>();
+        local_loan<int> id = local.get_shared(&session::m_id);
+        decay_ptr<session, single_thread> degraded(std::move(local));
+        assert(*id == 7 && !degraded.decayed());
+        id.reset();
+        assert(degraded.decayed());
+    }
+}
+
+#if defined(__linux__)
+struct blob
+{
+    int m_values[64];
+};
+
+static void test_ipc()
+{
+    // Two mappings of the same memory, at different addresses, stand in
+    // for two processes.
+    const std::size_t size = 4096;
+    const int fd = ::memfd_create("test_ipc", 0);
+    assert(fd >= 0 && ::ftruncate(fd, size) == 0);
+    void* owner_map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* remote_map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(owner_map != MAP_FAILED && remote_map != MAP_FAILED && owner_map != remote_map);
+
+    {
+        ipc_strong_ptr<blob> strong = make_ipc_strong<blob>(owner_map, size);
+        for (int i = 0; i < 64; ++i) strong->m_values[i] = i;
+        ipc_loan<blob> remote = ipc_loan<blob>::take(remote_map);
+        assert(remote && remote.get() != strong.get() && remote->m_values[63] == 63);
+        assert(!ipc_loan<int>::take(remote_map));
+        ipc_loan<blob> local = strong.get_shared();
+        ipc_loan<blob> copy = remote;
+
+        ipc_decay_ptr<blob> degraded(std::move(strong));
+        assert(!strong && !degraded.decayed());
+        // no new loans once decaying
+        assert(!ipc_loan<blob>::take(remote_map));
+        local.reset();
+        copy.reset();
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        std::thread thread([&remote] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            remote.reset();
+        });
+        degraded.wait();
+        thread.join();
+        assert(degraded.decayed() && degraded->m_values[5] == 5);
+        assert(degraded.wait_for(std::chrono::seconds(1)) == std::cv_status::no_timeout);
+    }
+    {
+        // the segment can be reused once decayed
+        ipc_decay_ptr<blob> degraded(make_ipc_strong<blob>(owner_map, size));
+        assert(degraded.decayed());
+        bool thrown = false;
+        try {
+            make_ipc_strong<blob>(owner_map, sizeof(blob));
+        } catch (const std::bad_alloc&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    ::munmap(owner_map, size);
+    ::munmap(remote_map, size);
+    ::close(fd);
+}
+#endif
+
+static void test_array()
+{
+    {
+        strong_ptr<int[]> array = make_strong_array<int>(8);
+        assert(array && array.size() == 8 && array[7] == 0);
+        for (std::size_t i = 0; i < array.size(); ++i) array[i] = static_cast<int>(i);
+        loan_slice<int> whole = array.get_shared();
+        assert(whole.size() == 8 && whole.data() == array.get());
+        loan_slice<int> slice = array.get_shared(2, 4);
+        assert(slice && slice.size() == 4 && slice[0] == 2 && slice[3] == 5);
+        int sum = 0;
+        for (int value : slice) sum += value;
+        assert(sum == 2 + 3 + 4 + 5);
+        loan_slice<int> sub = slice.subslice(1, 2);
+        assert(sub.size() == 2 && sub[0] == 3 && sub[1] == 4);
+        assert(array.get_shared(8, 0).empty() && array.get_shared(8, 0));
+
+        decay_ptr<int[]> degraded(std::move(array));
+        assert(!array && degraded.size() == 8 && degraded[2] == 2);
+        whole.reset();
+        slice.reset();
+        assert(!degraded.decayed());
+        sub.reset();
+        assert(degraded.decayed());
+
+        array = degraded.rearm();
+        assert(array.size() == 8 && array[5] == 5 && !degraded);
+    }
+    {
+        strong_ptr<int[]> null;
+        assert(!null && null.size() == 0 && !null.get_shared());
+        decay_ptr<int[]> degraded(std::move(null));
+        assert(degraded.decayed());
+    }
+    // elements are destroyed once decayed, with the allocator's memory
+    {
+        int allocs = 0;
+        {
+            strong_ptr<my_struct[]> array = allocate_strong_array<my_struct>(counting_allocator<my_struct>(allocs), 4);
+            assert(allocs == 2 && array[3].valid());
+            auto slice = array.get_shared(3, 1);
+            decay_ptr<my_struct[]> degraded(std::move(array));
+            std::thread thread([&slice] { slice.reset(); });
+            degraded.wait();
+            thread.join();
+            assert(degraded[0].valid());
+        }
+        assert(allocs == 0);
+    }
+    {
+        strong_ptr<int[], single_thread> local = make_strong_array<int>(4);
+        loan_slice<int, single_thread> slice = local.get_shared(1, 2);
+        decay_ptr<int[], single_thread> degraded(std::move(local));
+        assert(!degraded.decayed());
+        slice.reset();
+        assert(degraded.decayed());
+    }
+    // neither can be sliced down to their single-object counterparts
+    static_assert(!std::is_convertible<strong_ptr<int[]>*, strong_ptr<int>*>::value, "strong_ptr<T[]> must not be sliceable");
+    static_assert(!std::is_convertible<decay_ptr<int[]>*, decay_ptr<int>*>::value, "decay_ptr<T[]> must not be sliceable");
+}
+
+#if STRONG_PTR_INSTRUMENT
+struct counting_sink : strong_ptr_sink {
+    void on_loan(const void* object) override
+    {
+        if (object == m_object) ++m_loans;
+    }
+    void on_decay_started(const void* object) override
+    {
+        if (object == m_object) ++m_started;
+    }
+    void on_decayed(const void* object, std::chrono::nanoseconds elapsed) override
+    {
+        if (object != m_object) return;
+        ++m_decayed;
+        m_elapsed = elapsed;
+    }
+    void on_wait(const void* object, std::chrono::nanoseconds) override
+    {
+        if (object == m_object) ++m_waits;
+    }
+    const void* m_object{nullptr};
+    std::atomic<int> m_loans{0};
+    std::atomic<int> m_started{0};
+    std::atomic<int> m_decayed{0};
+    std::atomic<int> m_waits{0};
+    std::chrono::nanoseconds m_elapsed{0};
+};
+
+static void test_instrument()
+{
+    counting_sink sink;
+    strong_ptr_instrument::set_sink(&sink);
+    // every event of a strong_ptr's life reaches the sink
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        sink.m_object = strong.get();
+        auto shared = strong.get_shared();
+        auto other = strong.get_shared();
+        assert(sink.m_loans == 2);
+        {
+            loan_ref<my_struct> borrowed = strong.borrow();
+            loan_batch<my_struct> batch = strong.get_shared_n(3);
+            auto locked = strong.get_weak().lock();
+            assert(sink.m_loans == 2 + 1 + 3 + 1);
+        }
+        sink.m_loans = 2;
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(sink.m_started == 1);
+        assert(sink.m_decayed == 0);
+        std::thread thread([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            shared.reset();
+            other.reset();
+        });
+        degraded.wait();
+        thread.join();
+        assert(sink.m_decayed == 1);
+        assert(sink.m_elapsed >= std::chrono::milliseconds(10));
+        assert(sink.m_waits == 1);
+    }
+    // pointers that are destroyed without decaying don't report a decay
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        sink.m_object = strong.get();
+        sink.m_decayed = 0;
+        strong.reset();
+        assert(sink.m_decayed == 0);
+    }
+#if STRONG_PTR_INSTRUMENT >= 2
+    // outstanding loans can be traced back to where they were taken
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        const int line = __LINE__ + 1;
+        auto shared = strong.get_shared();
+        assert(shared.get() == strong.get());
+        std::vector<strong_loan_record> records = strong_loan_registry::outstanding(strong.get());
+        assert(records.size() == 1);
+        assert(records[0].m_site.m_line == line);
+        assert(std::string(records[0].m_site.m_file).find("test_strong_ptr.cpp") != std::string::npos);
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(!degraded.decayed());
+        shared.reset();
+        assert(degraded.decayed());
+        assert(strong_loan_registry::outstanding(degraded.get()).empty());
+    }
+    // loans from one site share a record, until the object's loans are all gone
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::vector<std::shared_ptr<my_struct>> loans;
+        for (int i = 0; i < 3; ++i) {
+            loans.push_back(strong.get_shared());
+        }
+        assert(loans.back().use_count() == 4);
+        std::vector<strong_loan_record> records = strong_loan_registry::outstanding(strong.get());
+        assert(records.size() == 1 && records[0].m_loans == 3);
+        loans.clear();
+        assert(strong_loan_registry::outstanding(strong.get()).size() == 1);
+        const void* object = strong.get();
+        strong.reset();
+        assert(strong_loan_registry::outstanding(object).empty());
+    }
+    // so are those taken through the wrappers, rather than in their headers
+    {
+        atomic_strong_cell<int> cell(make_strong<int>(1));
+        replicated_strong_ptr<int> replicated = make_replicated_strong<int>(2);
+        const int line = __LINE__ + 1;
+        auto from_cell = cell.get_shared();
+        auto from_replica = replicated.get_shared();
+        auto from_node = replicated.get_shared(0);
+        for (const void* object : {static_cast<const void*>(from_cell.get()), static_cast<const void*>(from_replica.get()), static_cast<const void*>(from_node.get())}) {
+            for (const strong_loan_record& record : strong_loan_registry::outstanding(object)) {
+                assert(record.m_site.m_line >= line && record.m_site.m_line <= line + 2);
+                assert(std::string(record.m_site.m_file).find("test_strong_ptr.cpp") != std::string::npos);
+            }
+        }
+        assert(strong_loan_registry::outstanding(from_cell.get()).size() == 1);
+        assert(strong_loan_registry::outstanding(from_replica.get()).size() >= 1);
+    }
+#endif
+    strong_ptr_instrument::set_sink(nullptr);
+}
+#endif
+
+static void test_numa()
+{
+    const strong_numa_topology& topology = strong_numa_topology::get();
+    assert(topology.nodes() >= 1);
+    assert(strong_numa_node() < topology.nodes());
+    // objects placed on a node behave like any other
+    {
+        strong_ptr<my_struct> strong = make_strong_on_node<my_struct>(0);
+        strong_ptr<int> local = make_strong_local<int>(5);
+        assert(*local.get() == 5);
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        shared.reset();
+        degraded.wait();
+        assert(degraded.decayed());
+    }
+    // there is a copy per node, and decay waits for the loans of all of them
+    {
+        replicated_strong_ptr<std::array<int, 3>> replicated = make_replicated_strong<std::array<int, 3>>(std::array<int, 3>{{7, 7, 7}});
+        assert(replicated && replicated.replicas() == topology.nodes());
+        assert(replicated->size() == 3 && (*replicated)[2] == 7);
+        std::shared_ptr<const std::array<int, 3>> here = replicated.get_shared();
+        std::shared_ptr<const std::array<int, 3>> last = replicated.get_shared(topology.nodes() - 1);
+        assert(*here == *last);
+        // unknown nodes fall back to the first copy
+        assert(replicated.get_shared(topology.nodes()).get() == replicated.get_shared(0).get());
+        replicated_decay_ptr<std::array<int, 3>> degraded(std::move(replicated));
+        assert(!replicated);
+        assert(!degraded.decayed());
+        here.reset();
+        assert(!degraded.decayed());
+        std::thread thread([&] { last.reset(); });
+        assert(degraded.wait_for(std::chrono::seconds(10)) == std::cv_status::no_timeout);
+        thread.join();
+        assert(degraded.decayed());
+        assert(degraded.get()->size() == 3);
+        degraded.reset();
+        assert(!degraded);
+    }
+}
+
+static void test_atomic_cell()
+{
+    {
+        atomic_strong_cell<int> cell;
+        assert(!cell.get_shared());
+        decay_ptr<int> previous = cell.exchange(make_strong<int>(1));
+        assert(!previous && previous.decayed());
+        auto loan = cell.get_shared();
+        assert(*loan == 1);
+        previous = cell.store(make_strong<int>(2));
+        assert(!previous.decayed() && *previous.get() == 1);
+        assert(*cell.get_shared() == 2);
+        loan.reset();
+        assert(previous.decayed());
+    }
+    {
+        atomic_strong_cell<int> cell(make_strong<int>(3));
+        assert(*cell.get_shared() == 3);
+    }
+    // readers race writers; every value read is alive and was published
+    {
+        atomic_strong_cell<int> cell(make_strong<int>(0));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t) {
+            readers.emplace_back([&] {
+                int last = 0;
+                while (!done) {
+                    std::shared_ptr<int> loan = cell.get_shared();
+                    assert(loan && *loan >= last);
+                    last = *loan;
+                }
+            });
+        }
+        for (int i = 1; i <= 2000; ++i) {
+            decay_ptr<int> previous = cell.exchange(make_strong<int>(i));
+            assert(*previous.get() == i - 1);
+            previous.wait();
+        }
+        done = true;
+        for (auto& reader : readers) reader.join();
+        assert(*cell.get_shared() == 2000);
+    }
+}
+
+static void test_decay_set()
+{
+    {
+        decay_set<my_struct> set;
+        assert(set.empty() && set.wait_any().empty());
+        set.wait_all();
+        std::vector<std::shared_ptr<my_struct>> loans;
+        for (int i = 0; i < 4; ++i) {
+            strong_ptr<my_struct> strong = make_strong<my_struct>();
+            loans.push_back(strong.get_shared());
+            set.add(decay_ptr<my_struct>(std::move(strong)));
+        }
+        set.add(decay_ptr<my_struct>(make_strong<my_struct>()));
+        assert(set.size() == 5);
+        // the one without loans is ready right away
+        std::vector<decay_ptr<my_struct>> decayed = set.wait_any();
+        assert(decayed.size() == 1 && decayed[0].decayed() && decayed[0]->valid());
+        assert(set.size() == 4);
+        assert(set.wait_any_for(std::chrono::milliseconds(1)).empty());
+        assert(!set.wait_all_for(std::chrono::milliseconds(1)));
+        loans[0].reset();
+        loans[1].reset();
+        decayed = set.wait_any_until(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+        assert(decayed.size() == 2 && set.size() == 2);
+        for (const auto& degraded : decayed) assert(degraded.decayed());
+        // freed slots are reused
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        loans.push_back(strong.get_shared());
+        set.add(std::move(strong));
+        assert(set.size() == 3);
+        loans.clear();
+        assert(set.wait_all_for(std::chrono::seconds(10)));
+        assert(set.size() == 3 && set.take_decayed().size() == 3 && set.empty());
+    }
+    // loans released on other threads, and a set going away before them
+    {
+        std::vector<std::thread> threads;
+        std::atomic<bool> go{false};
+        decay_set<my_struct> set;
+        for (int i = 0; i < 8; ++i) {
+            strong_ptr<my_struct> strong = make_strong<my_struct>();
+            threads.emplace_back([&go](std::shared_ptr<my_struct> loan) {
+                while (!go) std::this_thread::yield();
+                loan.reset();
+            }, strong.get_shared());
+            set.add(std::move(strong));
+        }
+        go = true;
+        set.wait_all();
+        assert(set.take_decayed().size() == 8);
+        for (auto& thread : threads) thread.join();
+        threads.clear();
+
+        go = false;
+        auto unfinished = std::make_unique<decay_set<my_struct>>();
+        for (int i = 0; i < 8; ++i) {
+            strong_ptr<my_struct> strong = make_strong<my_struct>();
+            threads.emplace_back([&go](std::shared_ptr<my_struct> loan) {
+                while (!go) std::this_thread::yield();
+                loan.reset();
+            }, strong.get_shared());
+            unfinished->add(std::move(strong));
+        }
+        unfinished.reset();
+        go = true;
+        for (auto& thread : threads) thread.join();
+    }
+}
+
+static bool readable(const decay_fd& fd, int timeout_ms)
+{
+    pollfd pfd{fd.fd(), POLLIN, 0};
+    return ::poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_decay_fd()
+{
+    decay_fd fd;
+    assert(!readable(fd, 0) && !fd.reset());
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        fd.watch(degraded);
+        assert(!readable(fd, 0));
+        std::thread thread([&shared] { shared.reset(); });
+        assert(readable(fd, 10000));
+        thread.join();
+        assert(degraded.decayed());
+        assert(fd.reset() && !readable(fd, 0));
+        // already decayed
+        decay_ptr<my_struct> unloaned(make_strong<my_struct>());
+        fd.watch(unloaned);
+        assert(fd.reset());
+    }
+    // a whole set, signaling on every decay until reset
+    {
+        decay_set<my_struct> set;
+        fd.watch(set);
+        std::vector<std::shared_ptr<my_struct>> loans;
+        for (int i = 0; i < 3; ++i) {
+            strong_ptr<my_struct> strong = make_strong<my_struct>();
+            loans.push_back(strong.get_shared());
+            set.add(std::move(strong));
+        }
+        loans[0].reset();
+        loans[1].reset();
+        assert(readable(fd, 0) && fd.reset() && !readable(fd, 0));
+        assert(set.take_decayed().size() == 2);
+        loans.clear();
+        assert(fd.reset() && set.take_decayed().size() == 1);
+    }
+    // decays after the decay_fd is gone are harmless
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        {
+            decay_fd gone;
+            gone.watch(degraded);
+        }
+        shared.reset();
+    }
+}
+
+static void test_reclaimer()
+{
+    // objects are destroyed on the reclaimer thread once they have decayed
+    {
+        std::atomic<std::thread::id> destroyed_on{};
+        std::atomic<std::thread::id> destroyed_on_unloaned{};
+        std::atomic<std::thread::id> reclaimer_thread{};
+        std::shared_ptr<reclaimed> shared;
+        {
+            strong_reclaimer reclaimer(16, [&] { reclaimer_thread = std::this_thread::get_id(); });
+            strong_ptr<reclaimed> strong = make_strong<reclaimed>(destroyed_on);
+            shared = strong.get_shared();
+            reclaimer.retire(std::move(strong));
+            assert(!strong && reclaimer.pending() == 1);
+            reclaimer.retire(make_strong<reclaimed>(destroyed_on_unloaned));
+            strong_ptr<reclaimed> null;
+            reclaimer.retire(std::move(null));
+            shared.reset();
+        }
+        assert(destroyed_on.load() == reclaimer_thread.load());
+        assert(destroyed_on_unloaned.load() == reclaimer_thread.load());
+        assert(destroyed_on.load() != std::this_thread::get_id());
+    }
+    // every one of them, however the releasing threads race the reclaimer
+    {
+        const std::size_t count = 5000;
+        std::vector<std::atomic<std::thread::id>> destroyed_on(count);
+        std::atomic<std::thread::id> reclaimer_thread{};
+        {
+            strong_reclaimer reclaimer(64, [&] { reclaimer_thread = std::this_thread::get_id(); });
+            std::vector<std::shared_ptr<reclaimed>> loans;
+            for (std::size_t i = 0; i < count; ++i) {
+                strong_ptr<reclaimed> strong = make_strong<reclaimed>(destroyed_on[i]);
+                loans.push_back(strong.get_shared());
+                reclaimer.retire(std::move(strong));
+                if (loans.size() == 32) {
+                    // half of them released here, half on another thread
+                    std::vector<std::shared_ptr<reclaimed>> other(loans.begin() + 16, loans.end());
+                    loans.resize(16);
+                    std::thread thread([&other] { other.clear(); });
+                    loans.clear();
+                    thread.join();
+                }
+            }
+            loans.clear();
+        }
+        for (const auto& thread : destroyed_on) {
+            assert(thread.load() == reclaimer_thread.load());
+        }
+    }
+    // retire() blocks while max_pending objects haven't been destroyed
+    {
+        strong_reclaimer reclaimer(2);
+        std::vector<std::shared_ptr<my_struct>> loans;
+        for (int i = 0; i < 2; ++i) {
+            strong_ptr<my_struct> strong = make_strong<my_struct>();
+            loans.push_back(strong.get_shared());
+            reclaimer.retire(std::move(strong));
+        }
+        std::atomic<bool> retired{false};
+        std::thread thread([&] {
+            reclaimer.retire(make_strong<my_struct>());
+            retired = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        assert(!retired && reclaimer.pending() == 2);
+        loans.pop_back();
+        thread.join();
+        assert(retired);
+        loans.clear();
+    }
+    // many threads releasing many loans
+    {
+        strong_reclaimer reclaimer(64);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&reclaimer] {
+                for (int i = 0; i < 200; ++i) {
+                    strong_ptr<my_struct> strong = make_strong<my_struct>();
+                    std::shared_ptr<my_struct> loan = strong.get_shared();
+                    reclaimer.retire(std::move(strong));
+                    assert(loan->valid());
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+    }
+}
+
+static void test_sharding()
+{
+    // loans from any shard keep the object alive and delay decay
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        strong.enable_sharding(4);
+        auto shared = strong.get_shared();
+        assert(shared.get() == strong.get());
+        std::shared_ptr<my_struct> other;
+        std::thread([&] { other = strong.get_shared(); }).join();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(!degraded.decayed());
+        shared.reset();
+        assert(!degraded.decayed());
+        other.reset();
+        assert(degraded.decayed());
+        assert(!deleted);
+        degraded.reset();
+        assert(deleted);
+    }
+    // the object outlives its strong_ptr as long as a sharded loan does
+    {
+        bool deleted = false;
+        strong_ptr<my_struct> strong(new my_struct(), Deleter(deleted));
+        strong.enable_sharding(2);
+        auto shared = strong.get_shared();
+        strong.reset();
+        assert(!deleted);
+        shared.reset();
+        assert(deleted);
+    }
+    // decay waits for the loans of every shard, taken on many threads
+    for (int i = 0; i < 20; ++i) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        strong.enable_sharding(3);
+        std::vector<std::thread> threads;
+        std::atomic<int> taken{0};
+        std::atomic<bool> release{false};
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] {
+                std::vector<std::shared_ptr<my_struct>> loans;
+                for (int j = 0; j < 100; ++j) loans.push_back(strong.get_shared());
+                ++taken;
+                while (!release.load()) std::this_thread::yield();
+            });
+        }
+        while (taken.load() != 4) std::this_thread::yield();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(!degraded.decayed());
+        release = true;
+        degraded.wait();
+        assert(degraded.decayed());
+        for (auto& thread : threads) thread.join();
+    }
+}
+
+static void test_wait()
+{
+    // already decayed
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait();
+        assert(degraded.wait_for(std::chrono::hours(1)) == std::cv_status::no_timeout);
+        assert(degraded.wait_until(std::chrono::steady_clock::now() + std::chrono::hours(1)) == std::cv_status::no_timeout);
+    }
+    // the last loan is dropped after a while, by another thread
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::thread thr([](std::shared_ptr<my_struct> shared) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            assert(shared->valid());
+        }, strong.get_shared());
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait();
+        assert(degraded.decayed());
+        assert(degraded->valid());
+        thr.join();
+    }
+    // timeouts
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        auto shared = strong.get_shared();
+        decay_ptr<my_struct> degraded(std::move(strong));
+        assert(degraded.wait_for(std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        assert(degraded.wait_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(1)) == std::cv_status::timeout);
+        std::thread thr([&] { shared.reset(); });
+        assert(degraded.wait_for(std::chrono::hours(1)) == std::cv_status::no_timeout);
+        assert(degraded.decayed());
+        thr.join();
+    }
+    // spinning first
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::thread thr([](std::shared_ptr<my_struct> shared) { shared.reset(); }, strong.get_shared());
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait(spin_then_block());
+        assert(degraded.decayed());
+        thr.join();
+    }
+    {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::thread thr([](std::shared_ptr<my_struct> shared) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            shared.reset();
+        }, strong.get_shared());
+        decay_ptr<my_struct> degraded(std::move(strong));
+        degraded.wait(spin_then_block(0));
+        assert(degraded.decayed());
+        thr.join();
+    }
+    // many waiters, and loans dropped while the waits are starting
+    for (int i = 0; i < 100; ++i) {
+        strong_ptr<my_struct> strong = make_strong<my_struct>();
+        std::vector<std::thread> holders;
+        for (int j = 0; j < 2; ++j) {
+            holders.emplace_back([](std::shared_ptr<my_struct> shared) { shared.reset(); }, strong.get_shared());
+        }
+        decay_ptr<my_struct> degraded(std::move(strong));
+        std::vector<std::thread> waiters;
+        waiters.emplace_back([&] { degraded.wait(); });
+        waiters.emplace_back([&] { assert(degraded.wait_for(std::chrono::hours(1)) == std::cv_status::no_timeout); });
+        waiters.emplace_back([&] { degraded.wait([&] { return degraded.decayed(); }); });
+        degraded.wait();
+        assert(degraded.decayed());
+        for (auto& thr : waiters) thr.join();
+        for (auto& thr : holders) thr.join();
+    }
 }
 
 int main()
 {
     test_construction();
+    test_make_strong();
+    test_allocator();
+#if STRONG_PTR_BLOCK_CACHE
+    test_block_cache();
+#endif
+    test_lazy_wake();
     test_deletion();
     test_shared_outlives_strong();
     test_use_count();
+    test_borrow();
+    test_loan_batch();
+    test_single_thread();
+    test_intrusive();
+    test_rearm();
+    test_pool();
+    test_on_decay();
+#if STRONG_PTR_COROUTINES
+    test_coroutine();
+#endif
+    test_weak();
+    test_release_unique();
+    test_projection();
+    test_array();
+#if defined(__linux__)
+    test_ipc();
+#endif
+    test_numa();
+#if STRONG_PTR_INSTRUMENT
+    test_instrument();
+#endif
+    test_atomic_cell();
+    test_decay_set();
+    test_decay_fd();
+    test_reclaimer();
+    test_sharding();
+    test_wait();
 }